@@ -168,6 +168,98 @@ static int rcount, awoke;
 
 @end
 
+@interface KeyedRecord : OORecord {
+@public
+	NSArray *list;
+}
+@end
+
+@implementation KeyedRecord
+
++ (NSString *)ooTableName { return @"CODEC_TABLE"; };
++ (NSDictionary *)ooColumnCodecs {
+	return [NSDictionary dictionaryWithObject:OO_AUTORELEASE( [[OOKeyedArchiveCodec alloc] init] ) forKey:@"list"];
+}
+
+- (void)dealloc { OO_RELEASE( list ); return OO_DEALLOC( super ); }
+
+@end
+
+@interface CodecRecord : OORecord {
+@public
+	NSArray *list;
+}
+@end
+
+@implementation CodecRecord
+
++ (NSString *)ooTableName { return @"CODEC_TABLE"; };
+
+- (void)dealloc { OO_RELEASE( list ); return OO_DEALLOC( super ); }
+
+@end
+
+@interface SearchRecord : OORecord {
+@public
+	OOString ID, words;
+}
+@end
+
+@implementation SearchRecord
+
++ (NSString *)ooTableName { return @"SEARCH_TABLE"; };
++ (NSString *)ooTableKey { return @"ID"; }
++ (NSString *)ooFullTextColumns { return @"words"; }
+
+@end
+
+@interface ImportRecord : OORecord {
+@public
+	OOString ID;
+	int i;
+	double d;
+}
+@end
+
+@implementation ImportRecord
+
++ (NSString *)ooTableName { return @"IMPORT_TABLE"; };
+
+@end
+
+@interface TrackedRecord : OORecord {
+@public
+	OOString ID, name;
+	int i;
+	double d;
+}
+@end
+
+@implementation TrackedRecord
+
++ (NSString *)ooTableName { return @"TRACKED_TABLE"; };
++ (NSString *)ooTableKey { return @"ID"; }
++ (BOOL)ooTracksChanges { return YES; }
+
+@end
+
+@interface PictureRecord : OORecord {
+@public
+	OOString ID;
+	NSData *pic;
+}
+@end
+
+@implementation PictureRecord
+
++ (NSString *)ooTableName { return @"PICTURE_TABLE"; };
++ (NSString *)ooTableKey { return @"ID"; }
++ (NSString *)ooDeferredColumns { return @"pic"; }
+
+- (void)dealloc { OO_RELEASE( pic ); return OO_DEALLOC( super ); }
+
+@end
+
 @interface iTunesItem : OORecord {
 	OOString title, link, description, pubDate, encoded, category, 
 	artist, artistLink, album, albumLink, albumPrice;
@@ -1484,6 +1576,12 @@ static BOOL allTests = TRUE, memoryManaged = NO, useNetwork = TRUE;
 			}
 			assert( [OODatabase commitTransaction] == 1+i );
 		}
+		assert( [*[[OODatabase sharedInstance] statementCacheStatistics][@"hits"] intValue] > 0 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from PARENT_TABLE"] == "10" );
+		assert( [[OODatabase sharedInstance] exec:@"select count(*) as n from PARENT_TABLE"] );
+		assert( [*[OODatabase sharedInstance]->results[0][@"n"] intValue] == 10 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select 1"] == "1" );
+		assert( [*[OODatabase sharedInstance]->results[0][@"n"] intValue] == 10 );
     
 		// select using a record as a filter
 		ParentRecord *filter = [ParentRecord record];
@@ -1507,6 +1605,257 @@ static BOOL allTests = TRUE, memoryManaged = NO, useNetwork = TRUE;
 		filter->ID = "ID%";
 		sel1.fetch( filter, nil );
 		assert( (int)sel1 == 10 );
+
+		// stream the same records through a cursor
+		int streamed = 0;
+		for ( ParentRecord *p : [ParentRecord cursorRelatedTo:filter] )
+			streamed += p->ID & "ID" ? 1 : 0;
+		assert( streamed == 10 );
+
+		// related tables for all records in one query agree with each record alone
+		OOArray<OOArray<OOMetaData *> > related = [[OODatabase sharedInstance] tablesRelatedByNaturalJoinFromArray:sel1];
+		assert( (int)related == 10 );
+		for ( int r=0 ; r<sel1 ; r++ )
+			assert( (int)*related[r] == (int)[[OODatabase sharedInstance] tablesRelatedByNaturalJoinFrom:*sel1[r]] );
+
+		// upsert by key updates the existing row
+		ParentRecord *upsert = [ParentRecord record];
+		upsert->ID = "ID5";
+		upsert->i = -1;
+		[OODatabase upsert:upsert];
+		assert( [OODatabase commit] == 1 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from PARENT_TABLE"] == "10" );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select i from PARENT_TABLE where ID = 'ID5'"] == "-1" );
+
+		// rollback of an upsert restores the values of the row it would have replaced
+		upsert->i = -2;
+		[OODatabase upsert:upsert];
+		[OODatabase rollback];
+		assert( upsert->i == -1 );
+
+		// children of all parents in one query agree with those selected for each parent
+		OOArray<OOArray<id> > prefetched = [ChildRecord selectRecordsRelatedToArray:sel1];
+		assert( (int)prefetched == 10 );
+		for ( int r=0 ; r<sel1 ; r++ )
+			assert( (int)*prefetched[r] == (int)[(ParentRecord *)*sel1[r] children] );
+
+		// statements are timed once profiling is enabled
+		[[OODatabase sharedInstance] enableProfiling:YES];
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from CHILD_TABLE where ID = 'ID5'"] == "5" );
+		OODictionary<NSDictionary *> profiled = [[OODatabase sharedInstance] profileStatistics];
+		NSDictionary *count = *profiled[@"select count(*) from CHILD_TABLE where ID = ?"];
+		assert( [[count valueForKey:@"rows"] intValue] == 1 && [[count valueForKeyPath:@"step.count"] intValue] == 1 );
+		[[OODatabase sharedInstance] enableProfiling:NO];
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from CHILD_TABLE where ID = 'ID5'"] == "5" );
+		count = *[[OODatabase sharedInstance] profileStatistics][@"select count(*) from CHILD_TABLE where ID = ?"];
+		assert( [[count valueForKeyPath:@"step.count"] intValue] == 1 );
+
+		// a file written by export: is imported in place a window of lines at a time
+		[OODatabase exec:@"drop table if exists IMPORT_TABLE"];
+		OOArray<ImportRecord *> exported;
+		for ( int i=0 ; i<100 ; i++ ) {
+			ImportRecord *r = [ImportRecord record];
+			r->ID = OO"ID"+i;
+			r->i = i;
+			r->d = i*.5;
+			exported += r;
+		}
+		NSString *importPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"objsql_import.txt"];
+		assert( [OOMetaData export:*exported toFile:importPath delimiter:"\t"] == 100 );
+		assert( [[OODatabase sharedInstance] importFile:importPath intoClass:[ImportRecord class] delimiter:"\t"] == 100 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select sum(i)||' '||sum(d) from IMPORT_TABLE"] == "4950 2475.0" );
+		OODictionary<NSNumber *> imported = [[OODatabase sharedInstance] importStatistics];
+		assert( [*imported[@"rows"] intValue] == 100 && [*imported[@"failed"] intValue] == 0 );
+
+		// newlines in text survive an export followed by either importer
+		ImportRecord *multiLine = [ImportRecord record];
+		multiLine->ID = "LINE1\nLINE2";
+		multiLine->i = 100;
+		OOArray<id> multiLines = OOArray<id>( multiLine, nil );
+		assert( [OOMetaData export:*multiLines toFile:importPath delimiter:"\t"] == 1 );
+		assert( [[OODatabase sharedInstance] importFile:importPath intoClass:[ImportRecord class] delimiter:"\t"] == 1 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select ID from IMPORT_TABLE where i = 100"] == "LINE1\nLINE2" );
+		OOArray<ImportRecord *> reimported = [OOMetaData import:[OOMetaData export:multiLines delimiter:"\t"]
+													  intoClass:[ImportRecord class] delimiter:"\t"];
+		ImportRecord *reimport = *reimported[0];
+		assert( (int)reimported == 1 && reimport->ID == "LINE1\nLINE2" );
+		[OODatabase exec:@"delete from IMPORT_TABLE where i = 100"];
+
+		// commits made asynchronously inside the window are applied as one group
+		__block int asyncUpdated = 0, asyncCompleted = 0;
+		for ( int i=0 ; i<2 ; i++ ) {
+			ImportRecord *r = [ImportRecord record];
+			r->ID = OO"ASYNC"+i;
+			[r insert];
+			[OODatabase commitAsync:^( int updated, int errcode, NSString *errmsg ) {
+				asyncUpdated += updated;
+				asyncCompleted += errcode == 0;
+			}];
+		}
+		[[OODatabase sharedInstance] waitForCommits];
+		assert( asyncUpdated == 2 && asyncCompleted == 2 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from IMPORT_TABLE"] == "102" );
+
+		// page through the parents four at a time by key
+		int paged = 0;
+		for ( OOArray<id> page = [ParentRecord selectPage:4 after:nil] ; page > 0 ;
+			 page = [ParentRecord selectPage:4 after:*page[-1]] )
+			paged += (int)page;
+		assert( paged == 10 && [ParentRecord estimatedCount] == 10 );
+		assert( (int)[ParentRecord selectPage:4 offset:8] == 2 );
+
+		// with concurrent readers the thread that began a transaction reads its own rows
+		NSString *walPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"objsql_wal.db"];
+		[[NSFileManager defaultManager] removeItemAtPath:walPath error:NULL];
+		OOReference<OODatabase *> wal;
+		OO_RELEASE( *(wal = [[OODatabase alloc] initPath:walPath]) );
+		assert( [*wal enableConcurrentReaders:2] );
+		assert( [*wal exec:@"create table WAL_TABLE (n integer)"] );
+		assert( [*wal exec:@"BEGIN"] && [*wal exec:@"insert into WAL_TABLE values (1)"] );
+		assert( (int)[*wal select:@"select n from WAL_TABLE"] == 1 );
+		OOCursor<id> walCursor = [*wal cursor:@"select n from WAL_TABLE" intoClass:nil joinFrom:nil];
+		OORecordCursor *walRecords = *walCursor;
+		dispatch_sync( dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^{
+			[walRecords close];
+		} );
+		assert( [*wal exec:@"ROLLBACK"] );
+		assert( (int)[*wal select:@"select n from WAL_TABLE"] == 0 );
+
+		// full text search uses the index maintained by triggers
+		[OODatabase exec:@"drop table if exists SEARCH_TABLE"];
+		for ( int i=0 ; i<10 ; i++ ) {
+			SearchRecord *r = [SearchRecord record];
+			r->ID = OO"ID"+i;
+			r->words = OOFormat( @"word%d common", i );
+			[r insert];
+		}
+		assert( [OODatabase commit] == 10 );
+		assert( (int)[SearchRecord search:"word5"] == 1 && (int)[SearchRecord search:"comm*"] == 10 );
+
+		// a row replaced by indate: is taken out of the index
+		SearchRecord *replaced = [SearchRecord record];
+		replaced->ID = "ID5";
+		replaced->words = "replaced";
+		[replaced indate];
+		[OODatabase commit];
+		assert( (int)[SearchRecord search:"word5"] == 0 && (int)[SearchRecord search:"replaced"] == 1 &&
+			   (int)[SearchRecord search:"common"] == 9 );
+
+		// only the columns changed since update are written whether set or assigned
+		[OODatabase exec:@"drop table if exists TRACKED_TABLE"];
+		TrackedRecord *tracked = [TrackedRecord record];
+		tracked->ID = "T1";
+		[tracked insert];
+		assert( [OODatabase commit] == 1 );
+		[tracked update];
+		[tracked setValue:[NSNumber numberWithInt:-3] forKey:@"i"];
+		tracked->d = 2.5;
+		tracked->name = "tracked";
+		assert( [OODatabase commit] == 1 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select i||' '||d||' '||name from TRACKED_TABLE"] == "-3 2.5 tracked" );
+		[tracked update];
+		tracked->i = 7;
+		[OODatabase rollback];
+		assert( tracked->i == -3 );
+
+		// deferred columns are read when first used and can be written in place
+		[OODatabase exec:@"drop table if exists PICTURE_TABLE"];
+		for ( int i=0 ; i<10 ; i++ ) {
+			PictureRecord *p = [PictureRecord new];
+			p->ID = OO"ID"+i;
+			[p setValue:[*OOFormat( @"pic%d", i ) dataUsingEncoding:NSUTF8StringEncoding] forKey:@"pic"];
+			OO_RELEASE( [p insert] );
+		}
+		assert( [OODatabase commit] == 10 );
+		PictureRecord *pictures = [PictureRecord record];
+		pictures->ID = "ID7";
+		OOArray<PictureRecord *> found = [pictures select];
+		PictureRecord *lazy = found[0];
+		assert( !lazy->pic && [[lazy valueForKey:@"pic"] length] == 4 && lazy->pic );
+		OOReference<OOBlob *> blob = [[OODatabase sharedInstance] openBlob:"pic" ofRecord:lazy writable:YES];
+		assert( [*blob length] == 4 && [*blob write:[@"PIC" dataUsingEncoding:NSUTF8StringEncoding] atOffset:0] );
+		[*blob close];
+		assert( [[OODatabase sharedInstance] stringForSql:@"select cast(pic as text) from PICTURE_TABLE where ID = 'ID7'"] == "PIC7" );
+
+		// a record written back before its deferred column is loaded keeps the stored value
+		found = [pictures select];
+		PictureRecord *unloaded = found[0];
+		assert( !unloaded->pic );
+		[OODatabase indate:unloaded];
+		assert( [OODatabase commit] == 1 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select cast(pic as text) from PICTURE_TABLE where ID = 'ID7'"] == "PIC7" );
+
+		// each kind of value survives the binary codec and older keyed archives are still read
+		OOBinaryCodec *codec = [OOBinaryCodec sharedInstance];
+		NSArray *encoded = [NSArray arrayWithObjects:@"text", [NSNumber numberWithBool:YES],
+			[NSNumber numberWithLongLong:-12345678901LL], [NSNumber numberWithUnsignedLongLong:ULLONG_MAX],
+			[NSNumber numberWithDouble:1.5], [NSDate dateWithTimeIntervalSince1970:1000.],
+			[@"bytes" dataUsingEncoding:NSUTF8StringEncoding], [NSArray arrayWithObjects:@"a", [NSNumber numberWithInt:1], nil],
+			[NSDictionary dictionaryWithObject:@"v" forKey:@"k"], [NSURL URLWithString:@"http://example.com/"], nil];
+		for ( id value in encoded )
+			assert( [[codec decodeColumnData:[codec encodeColumnValue:value]] isEqual:value] );
+		assert( [codec decodeColumnData:[codec encodeColumnValue:nil]] == OONull );
+		assert( [[codec decodeColumnData:[NSKeyedArchiver archivedDataWithRootObject:encoded]] isEqual:encoded] );
+
+		// a table keeps the codec it was created with when +ooColumnCodecs differs
+		[OODatabase exec:@"drop table if exists CODEC_TABLE"];
+		KeyedRecord *keyed = [KeyedRecord record];
+		[keyed setValue:encoded forKey:@"list"];
+		[keyed insert];
+		CodecRecord *later = [CodecRecord record];
+		[later setValue:[NSArray arrayWithObject:@"later"] forKey:@"list"];
+		[later insert];
+		assert( [OODatabase commit] == 2 );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from CODEC_TABLE where hex(substr(list, 1, 3)) = '4F4F43'"] == "0" );
+		OOArray<CodecRecord *> decoded = [CodecRecord select];
+		assert( [((CodecRecord *)*decoded[0])->list isEqual:encoded] );
+
+		// aggregates are computed without creating records
+		assert( [ChildRecord count] == 45 && [[OODatabase sharedInstance] countOf:[ChildRecord class] joinFrom:*sel1[0]] == (int)[(ParentRecord *)*sel1[0] children] );
+		assert( [ParentRecord max:"d"] == 567.*9 && [ParentRecord min:"d"] == 0. );
+		OOReference<OOResultSet *> perParent = [ChildRecord aggregate:"count(*) as n" groupBy:"ID"];
+		assert( (*perParent)->nrows == 9 && [*perParent longLongForRow:8 column:1] == 9 );
+
+		// committed changes are published to subscribers to the class
+		__block int published = 0;
+		dispatch_queue_t feedQueue = dispatch_queue_create( "objsql.test.feed", DISPATCH_QUEUE_SERIAL );
+		id subscription = [[OODatabase sharedInstance] subscribeToChangesOf:[ChildRecord class] queue:feedQueue
+			handler:^( NSIndexSet *inserted, NSIndexSet *updated, NSIndexSet *deleted ) {
+				published += (int)[inserted count] - (int)[deleted count];
+			}];
+		ChildRecord *added = [ChildRecord insertWithParent:*sel1[0]];
+		assert( [OODatabase commit] == 1 );
+		dispatch_sync( feedQueue, ^{} );
+		assert( published == 1 );
+		[added delete];
+		assert( [OODatabase commit] == 1 );
+		dispatch_sync( feedQueue, ^{} );
+		assert( published == 0 );
+		[[OODatabase sharedInstance] unsubscribe:subscription];
+#ifndef OO_ARC
+		dispatch_release( feedQueue );
+#endif
+
+		// records in memory can be queried and joined as a table without inserting them
+		assert( [[OODatabase sharedInstance] createTable:"PARENTS_IN_MEMORY" overArray:sel1 ofClass:[ParentRecord class]] );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from PARENTS_IN_MEMORY where ID = 'ID3'"] == "1" );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from CHILD_TABLE join PARENTS_IN_MEMORY using (ID)"] == "45" );
+		assert( [[OODatabase sharedInstance] dropArrayTable:"PARENTS_IN_MEMORY"] );
+
+		// a constraint looked up in the index takes the affinity of its column
+		ImportRecord *five = [ImportRecord record];
+		five->ID = "5";
+		assert( [[OODatabase sharedInstance] createTable:"FIVE_IN_MEMORY" overArray:OOArray<id>( five, nil ) ofClass:[ImportRecord class]] );
+		assert( [[OODatabase sharedInstance] stringForSql:@"select count(*) from FIVE_IN_MEMORY where ID = 5"] == "1" );
+		assert( [[OODatabase sharedInstance] dropArrayTable:"FIVE_IN_MEMORY"] );
+
+		// rows already in memory are returned as the same instance
+		[[OODatabase sharedInstance] enableIdentityMap:YES];
+		assert( [child parent].get() == [child parent].get() );
+		OOReference<ParentRecord *> cached = [child parent];
+		[OODatabase exec:@"update PARENT_TABLE set i = i where ID = 'ID5'"];
+		assert( [child parent].get() != cached.get() );
+		[[OODatabase sharedInstance] enableIdentityMap:NO];
 	}
 #ifndef OO_ARC
 	assert( rcount == 0 ); 
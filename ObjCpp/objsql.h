@@ -67,6 +67,141 @@
 #define OOValueDictionary OODictionary<NSValue *>
 #define cOOValueDictionary const OOValueDictionary &
 
+@class OODatabase, OOMetaData, OOAdaptor, OOSqlProfile, OOChangeFeed;
+
+typedef void (^OOCommitCompletion)( int updated, int errcode, NSString *errmsg );
+typedef void (^OOChangeHandler)( NSIndexSet *inserted, NSIndexSet *updated, NSIndexSet *deleted );
+
+#pragma mark OOResultSet column oriented results of an ad-hoc select
+
+/**
+ Results of a select not into a record class as returned in database->resultSet by exec:.
+ Column names are stored once and values column by column with integers and reals
+ unboxed and text or blobs as offsets into a single shared buffer. It is an NSArray
+ of rows each of which is bridged lazily to an NSDictionary so results can still be
+ used as an array of dictionaries. Subscript by row number for a row or by column
+ name for an array of a column's values, or use the typed accessors to avoid boxing.
+ 
+ Usage:
+ <pre>
+ [OODatabase exec:@"select name, count(*) as n from sqlite_master group by name"];
+ OOResultSet *results = *[OODatabase sharedInstance]->resultSet;
+ for ( int row=0 ; row<results->nrows ; row++ )
+     NSLog( @"%@ %lld", results[row][@"name"], [results longLongForRow:row column:1] );
+ </pre>
+ */
+
+@interface OOResultSet : NSArray {
+@public
+	OOStringArray columnNames;
+	int nrows, ncols, capacity;
+	struct _ooResultColumn *column;
+	char *arena;
+	size_t arenaUsed, arenaSize;
+}
+
+- initStatement:(struct sqlite3_stmt *)stmt;
+- (void)addRow:(struct sqlite3_stmt *)stmt;
+
+- (int)columnIndex:(NSString *)name;
+- (int)typeForRow:(int)row column:(int)col;
+- (long long)longLongForRow:(int)row column:(int)col;
+- (double)doubleForRow:(int)row column:(int)col;
+- (NSString *)stringForRow:(int)row column:(int)col;
+- (id)valueForRow:(int)row column:(int)col;
+- (NSArray *)objectForKeyedSubscript:(NSString *)name;
+
+@end
+
+#pragma mark OORecordCursor steps through the results of a select a batch at a time
+
+/**
+ Enumerator returned by -[OODatabase cursor:intoClass:joinFrom:] which steps its statement
+ lazily, creating records a batch at a time inside an autorelease pool rather than
+ building the whole result set in memory. Supports fast enumeration. Records remain
+ valid until the next batch is fetched unless retained. Call close or release the
+ cursor to stop early.
+ */
+
+@interface OORecordCursor : NSEnumerator <NSFastEnumeration> {
+	OO_UNSAFE OODatabase *database;
+	OOReference<OOAdaptor *> adaptor;
+	struct sqlite3_stmt *stmt;
+	Class recordClass;
+	OOMetaData *metaData;
+	OOArray<id> batch;
+	int batchSize, next, *columnMap;
+	BOOL onWriter;
+}
+
+- initAdaptor:(OOAdaptor *)anAdaptor ofDatabase:(OODatabase *)aDatabase onWriter:(BOOL)isWriter
+	statement:(struct sqlite3_stmt *)aStmt intoClass:(Class)aClass metaData:(OOMetaData *)aMetaData;
+- (void)close;
+
+@end
+
+/**
+ C++ wrapper for a cursor so it can be used in a range based for loop and closed
+ automatically when it goes out of scope, for example when breaking out of a loop.
+ 
+ Usage:
+ <pre>
+ for ( Authors *author : [Authors cursor] )
+     if ( author->Au_id == "213-46-8915" )
+         break;
+ </pre>
+ */
+
+template <typename ETYPE>
+class OOCursor : public OOReference<OORecordCursor *> {
+public:
+	class iterator {
+		OO_UNSAFE OORecordCursor *cursor;
+		OO_UNSAFE id current;
+	public:
+		oo_inline iterator( OORecordCursor *cursor ) {
+			this->cursor = cursor;
+			current = [cursor nextObject];
+		}
+		oo_inline ETYPE operator * () const { return current; }
+		oo_inline iterator &operator ++ () { current = [cursor nextObject]; return *this; }
+		oo_inline bool operator != ( const iterator &other ) const { return current != other.current; }
+	};
+
+	oo_inline OOCursor() {}
+	oo_inline OOCursor( OORecordCursor *cursor ) { set( cursor ); }
+	oo_inline OOCursor( const OOCursor &cursor ) { set( cursor.get() ); }
+	oo_inline OOCursor &operator = ( const OOCursor &cursor ) { set( cursor.get() ); return *this; }
+
+	oo_inline iterator begin() const { return iterator( **this ); }
+	oo_inline iterator end() const { return iterator( nil ); }
+	oo_inline ETYPE next() const { return [**this nextObject]; }
+	oo_inline void close() const { [**this close]; }
+};
+
+#pragma mark OOBlob reads and writes the value of a column incrementally
+
+/**
+ Handle returned by -[OODatabase openBlob:ofRecord:writable:] to read or write the value
+ of a blob or text column of a row a range at a time using sqlite3_blob_read/write rather
+ than loading it into memory all at once. Writes can not change the length of a value so
+ use -[OODatabase reserveBlob:ofRecord:length:] first to make space. Writes take effect
+ immediately rather than on commit.
+ */
+
+@interface OOBlob : NSObject {
+	OOReference<OOAdaptor *> adaptor;
+	struct sqlite3_blob *blob;
+}
+
+- initAdaptor:(OOAdaptor *)anAdaptor blob:(struct sqlite3_blob *)aBlob;
+- (int)length;
+- (NSData *)read:(int)length atOffset:(int)offset;
+- (BOOL)write:(NSData *)data atOffset:(int)offset;
+- (void)close;
+
+@end
+
 #pragma mark OORecord abstract superclass for records
 
 /**
@@ -85,6 +220,7 @@
 - (id)insert OO_RETURNS;
 - (id)delete OO_RETURNS;
 - (void)update;
+- (void)changed:(NSString *)column;
 
 - (void)indate;
 - (void)upsert;
@@ -95,10 +231,25 @@
 + (OOArray<id>)select;
 + (OOArray<id>)select:(cOOString)sql;
 + (OOArray<id>)selectRecordsRelatedTo:(id)record;
++ (OOArray<OOArray<id> >)selectRecordsRelatedToArray:(const OOArray<id> &)parents;
++ (OOArray<id>)selectPage:(int)limit after:(id)record;
++ (OOArray<id>)selectPage:(int)limit offset:(int)offset;
++ (long long)estimatedCount;
++ (OOArray<id>)search:(cOOString)query;
+
++ (long long)count;
++ (double)sum:(cOOString)column;
++ (double)min:(cOOString)column;
++ (double)max:(cOOString)column;
++ (double)avg:(cOOString)column;
++ (OOReference<OOResultSet *>)aggregate:(cOOString)expressions groupBy:(cOOString)columns;
 
 + (id)record OO_AUTORETURNS;
 - (OOArray<id>)select;
 
++ (OOCursor<id>)cursor;
++ (OOCursor<id>)cursorRelatedTo:(id)record;
+
 + (int)importFrom:(OOFile &)file delimiter:(cOOString)delim;
 + (BOOL)exportTo:(OOFile &)file delimiter:(cOOString)delim;
 
@@ -116,24 +267,39 @@
 
 @interface OOMetaData : OORecord {
 @public
-	OOString tableTitle, tableName, recordClassName, keyColumns;
+	OOString tableTitle, tableName, recordClassName, keyColumns, rowidColumn, fullTextTable;
 	OOStringArray ivars, columns, outcols, joinableColumns, tablesWithNaturalJoin,
-		boxed, unbox, dates, archived, blobs, tocopy, indexes;
+		boxed, unbox, dates, archived, blobs, tocopy, indexes, keys, fullTextColumns, fullTextSQL,
+		deferredColumns, untracked;
 	OOStringDictionary types;
+	OODictionary<NSArray *> naturalJoins;
+	OODictionary<id> codecs;
 	OOString createTableSQL;
 	Class recordClass;
+	struct _ooIvarPlan *plan;
+	int nplan;
+	BOOL tracksChanges;
 }
 
 + (OOMetaData *)metaDataForClass:(Class)recordClass OO_RETURNS;
 - initClass:(Class)aClass;
 
 - (OOStringArray)naturalJoinTo:(cOOStringArray)to;
+- (OOStringArray)naturalJoinToTable:(OOMetaData *)other;
 - (cOOValueDictionary)encode:(cOOValueDictionary)values;
 - (cOOValueDictionary)decode:(cOOValueDictionary)values;
+- (OOValueDictionary)encodeRecord:(id)record;
+- (OOValueDictionary)encodeColumns:(cOOStringArray)names ofRecord:(id)record;
+- (id)valueForPlan:(int)p ofRecord:(id)record;
+- (void)useCodecsRecordedIn:(cOOString)sql;
+- (NSData *)ivarsOf:(id)record holding:(NSMutableArray *)held;
+- (void)addIvarsOf:(id)record changedSince:(NSData *)ivars to:(NSMutableIndexSet *)changes;
+- (void)restoreIvarsOf:(id)record from:(NSData *)ivars;
 
 + (OOArray<id>)import:(const OOArray<OODictionary<OOString> > &)nodes intoClass:(Class)recordClass;
 + (OOArray<id>)import:(cOOString)string intoClass:(Class)recordClass delimiter:(cOOString)delim;
 + (OOString)export:(const OOArray<id> &)array delimiter:(cOOString)delim;
++ (long)export:(id <NSFastEnumeration>)records toFile:(cOOString)path delimiter:(cOOString)delim;
 
 + (void)bindRecord:(id)record toView:(OOView *)view delegate:(id)delegate;
 + (void)updateRecord:(id)value fromView:(OOView *)view;
@@ -155,12 +321,47 @@
 + (NSString *)ooOrderBy;
 
 + (NSString *)ooConstraints;
++ (NSDictionary *)ooColumnCodecs;
++ (NSString *)ooFullTextColumns;
++ (BOOL)ooTracksChanges;
++ (NSString *)ooDeferredColumns;
 
 - (void)awakeFromDB;
 
 @end
 
-@class OOAdaptor;
+#pragma mark OOColumnCodec converts archived ivars to and from blobs
+
+/**
+ Codec used to store the values of object ivars other than strings, data and dates
+ as blobs. A class can use a codec of its own for particular columns by returning a
+ dictionary of column names to codecs from +ooColumnCodecs. Otherwise OOBinaryCodec
+ is used which reads values archived by the NSKeyedArchiver in earlier versions.
+ */
+
+@protocol OOColumnCodec <NSObject>
+
+- (NSData *)encodeColumnValue:(id)value;
+- (id)decodeColumnData:(NSData *)data;
+
+@end
+
+/**
+ Compact versioned binary encoding of property list values (strings, numbers, data,
+ dates, arrays and dictionaries) falling back to a keyed archive for other objects.
+ Arrays and dictionaries are decoded as mutable.
+ */
+
+@interface OOBinaryCodec : NSObject <OOColumnCodec>
++ (OOBinaryCodec *)sharedInstance;
+@end
+
+/**
+ Codec storing values using NSKeyedArchiver as all versions before OOBinaryCodec did.
+ */
+
+@interface OOKeyedArchiveCodec : NSObject <OOColumnCodec>
+@end
 
 #pragma mark OODatabase is the low level interface to a particular database
 
@@ -176,13 +377,60 @@
  To update a record, fetch it and call the update: method passing it in as the argument to 
  save it's preious values. You can then modify it and call commit to update it's record.
  Delete operations on objects also accumulate and need to be commited to take effect.
+ 
+ By default an instance should only be used from one thread at a time. After calling
+ enableConcurrentReaders: selects and cursors use a pool of read-only connections so
+ they can run on several threads at once while inserts, updates, deletes, commits and
+ exec: are serialised on the one writer connection. In this mode errcode, errmsg and
+ updateCount describe the last write; failed reads are logged and return nil.
+ 
+ commitAsync: hands the pending operations to a serial writer queue and returns at once.
+ Commits arriving within groupCommitWindow seconds of each other are applied in a single
+ sqlite transaction so they share one sync to disk. Each caller's completion block is
+ called on the writer queue with the count and error it would have had from commit.
+ 
+ With enableIdentityMap: selects and cursors return the instance already in memory for a
+ row rather than creating another while that instance is still alive. These instances
+ keep their values in memory so the map is cleared by any commit, exec:, import or blob
+ write that changes rows and by rollback.
+ 
+ enableProfiling: times the statements run on all connections using sqlite's tracing.
+ profileStatistics and profileJSON report the counts, times, rows and changes for each
+ statement with its literals replaced by "?". They remain available after profiling is
+ disabled until it is enabled again.
+ 
+ subscribeToChangesOf:queue:handler: calls a handler with the rowids of the rows of a
+ class's table inserted, updated and deleted by each commit, collected by sqlite's update
+ hook. A row inserted then deleted in the same batch is not reported and batches arriving
+ while the handler is still waiting to run are merged into one call.
+ 
+ createTable:overArray:ofClass: makes an array of records in memory available to SQL as a
+ read-only temporary table with the columns of its class, for example to join it to tables
+ in the database without inserting it first.
  */
 
 @interface OODatabase : NSObject {
 	OODictionary<OOMetaData *> tableMetaDataByClassName;
+	OOReference<NSObject *> metaDataLock;
 	OOReference<OOAdaptor *> adaptor;
+	OOArray<OOAdaptor *> readers;
+	dispatch_semaphore_t readersIdle;
+	dispatch_queue_t writerQueue;
+	OOArray<id> pendingCommits;
+	OOReference<NSMapTable *> identityMap;
+	OOReference<OOSqlProfile *> profile;
+	BOOL profiling;
+	int importedRows, importFailures;
+	double importSeconds;
+	OOReference<NSMutableSet *> schemaNames;
+	OOReference<OOChangeFeed *> changeFeed;
+	OOReference<NSMutableDictionary *> arrayTables;
 @public
+	double groupCommitWindow;
+	OO_UNSAFE NSThread *writerThread, *transactionThread;
+	int writerDepth;
 	OOArray<OOValueDictionary > transaction, results;
+	OOReference<OOResultSet *> resultSet;
 	int errcode, updateCount;
 	char *errmsg;
 	OOString lastSQL;
@@ -193,8 +441,10 @@
 
 + (BOOL)exec:(NSString *)sql, ...;
 + (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent;
++ (OOArray<OOArray<id> >)select:(cOOString)select intoClass:(Class)recordClass joinFromArray:(const OOArray<id> &)parents;
 + (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass;
 + (OOArray<id>)select:(cOOString)select;
++ (OOCursor<id>)cursor:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent;
 
 + (int)insertArray:(const OOArray<id> &)objects;
 + (int)deleteArray:(const OOArray<id> &)objects;
@@ -209,26 +459,57 @@
 + (int)commit;
 + (int)rollback;
 + (int)commitTransaction;
++ (void)commitAsync:(OOCommitCompletion)completion;
 
 - initPath:(cOOString)path;// __attribute__((objc_method_family(int)));
+- (BOOL)enableConcurrentReaders:(int)count;
+- (void)enableIdentityMap:(BOOL)enable;
+- (void)enableProfiling:(BOOL)enable;
+- (id)subscribeToChangesOf:(Class)recordClass queue:(dispatch_queue_t)queue handler:(OOChangeHandler)handler;
+- (void)unsubscribe:(id)subscription;
+- (BOOL)createTable:(cOOString)name overArray:(const OOArray<id> &)records ofClass:(Class)recordClass;
+- (BOOL)dropArrayTable:(cOOString)name;
 
 - (OOStringArray)registerSubclassesOf:(Class)recordSuperClass;
 - (void)registerTableClassesNamed:(cOOStringArray)classes;
 
 - (OOArray<OOMetaData *>)tablesRelatedByNaturalJoinFrom:(id)recordClass;
+- (OOArray<OOArray<OOMetaData *> >)tablesRelatedByNaturalJoinFromArray:(const OOArray<id> &)records;
 - (OOMetaData *)tableMetaDataForClass:(Class)recordClass OO_RETURNS;
 
 - (BOOL)exec:(NSString *)sql, ...;
 - (OOString)stringForSql:(NSString *)fmt, ...;
+- (int)importFile:(cOOString)path intoClass:(Class)recordClass delimiter:(cOOString)delim;
 - (id)copyJoinKeysFrom:(id)parent to:(id)newChild;
 
 - (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent;
+- (OOArray<OOArray<id> >)select:(cOOString)select intoClass:(Class)recordClass joinFromArray:(const OOArray<id> &)parents;
+- (OOArray<id>)selectPageOf:(Class)recordClass joinFrom:(id)parent after:(id)last limit:(int)limit;
+- (OOArray<id>)selectPageOf:(Class)recordClass joinFrom:(id)parent offset:(int)offset limit:(int)limit;
+- (long long)estimatedCountOf:(Class)recordClass;
+- (OOArray<id>)search:(cOOString)query intoClass:(Class)recordClass limit:(int)limit;
+- (long long)countOf:(Class)recordClass joinFrom:(id)parent;
+- (double)aggregate:(cOOString)function of:(cOOString)column inClass:(Class)recordClass joinFrom:(id)parent;
+- (OOReference<OOResultSet *>)aggregate:(cOOString)expressions inClass:(Class)recordClass
+								groupBy:(cOOString)columns joinFrom:(id)parent;
 - (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass;
 - (OOArray<id>)select:(cOOString)select;
+- (OOCursor<id>)cursor:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent;
 
 - (long long)rowIDForRecord:(id)record;
 - (long long)lastInsertRowID;
 
+- (id)deferredColumn:(cOOString)column ofRecord:(id)record;
+- (OOReference<OOBlob *>)openBlob:(cOOString)column ofRecord:(id)record writable:(BOOL)writable;
+- (BOOL)reserveBlob:(cOOString)column ofRecord:(id)record length:(int)length;
+
+- (OODictionary<NSNumber *>)statementCacheStatistics;
+- (OODictionary<NSNumber *>)bindStatistics;
+- (OODictionary<NSNumber *>)importStatistics;
+- (OODictionary<NSDictionary *>)profileStatistics;
+- (OOString)profileJSON;
+- (void)resetProfile;
+
 // all record modifications must be commited
 - (int)insertArray:(const OOArray<id> &)objects;
 - (int)deleteArray:(const OOArray<id> &)objects;
@@ -242,6 +523,8 @@
 
 - (int)commit;
 - (int)commitTransaction;
+- (void)commitAsync:(OOCommitCompletion)completion;
+- (void)waitForCommits;
 - (int)rollback;
 
 @end
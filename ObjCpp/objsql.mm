@@ -47,7 +47,11 @@
  */
 
 #import <objc/runtime.h>
+#import <objc/objc-sync.h>
 #import <sqlite3.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <fcntl.h>
 
 #import "objsql.h"
 
@@ -57,9 +61,128 @@
 #endif
 #endif
 
+/**
+ Number of prepared statements each connection keeps keyed by their SQL text.
+ Define as 0 to finalize every statement after use.
+ */
+
+#ifndef OOSQL_STMT_CACHE_SIZE
+#define OOSQL_STMT_CACHE_SIZE 50
+#endif
+
+/**
+ Upper bound on the rows in a single multi-row insert issued by commit. The actual
+ number is also limited by the number of parameters sqlite allows in a statement.
+ */
+
+#ifndef OOSQL_MAX_INSERT_ROWS
+#define OOSQL_MAX_INSERT_ROWS 500
+#endif
+
+/**
+ Number of records an OORecordCursor creates inside each autorelease pool.
+ */
+
+#ifndef OOSQL_CURSOR_BATCH
+#define OOSQL_CURSOR_BATCH 100
+#endif
+
+/**
+ Default seconds commitAsync: waits for further commits to include in the same transaction.
+ */
+
+#ifndef OOSQL_GROUP_COMMIT_WINDOW
+#define OOSQL_GROUP_COMMIT_WINDOW 0.002
+#endif
+
+/**
+ Size of each block of the arena text parameters are copied into for binding.
+ */
+
+#ifndef OOSQL_BIND_ARENA_BLOCK
+#define OOSQL_BIND_ARENA_BLOCK 16384
+#endif
+
+/**
+ Bytes of a file importFile: searches for line ends at a time. This bounds the memory used
+ for line offsets however large the file; lines longer than this grow the window.
+ */
+
+#ifndef OOSQL_IMPORT_WINDOW
+#define OOSQL_IMPORT_WINDOW (32*1024*1024)
+#endif
+
+/**
+ Size of the buffer export:toFile:delimiter: formats rows into before writing them out.
+ */
+
+#ifndef OOSQL_EXPORT_BUFFER
+#define OOSQL_EXPORT_BUFFER 65536
+#endif
+
+/**
+ Number of the most recent timings kept for each statement when profiling
+ from which the 99th percentile is calculated.
+ */
+
+#ifndef OOSQL_PROFILE_SAMPLES
+#define OOSQL_PROFILE_SAMPLES 512
+#endif
+
+/**
+ Milliseconds a connection waits for a lock held by another connection before
+ failing with SQLITE_BUSY when concurrent readers are enabled.
+ */
+
+#ifndef OOSQL_BUSY_TIMEOUT
+#define OOSQL_BUSY_TIMEOUT 5000
+#endif
+
+/**
+ Plan for reading and writing the instance variable behind each output column directly
+ rather than through key value coding. Built once per class by -[OOMetaData initClass:].
+ Ivars with accessor methods are not direct so any custom accessors are still called.
+ */
+
+struct _ooIvarPlan {
+	const char *name;
+	ptrdiff_t offset;
+	char type;
+	unsigned setDirect:1, getDirect:1, rowid:1, key:1, text:1, date:1, archived:1, boxed:1, unbox:1, deferred:1, tracked:1;
+	OO_UNSAFE id <OOColumnCodec> codec;
+};
+
 OOOODatabase OODB;
 
-static NSString *kOOObject = @"__OOOBJECT__", *kOOInsert = @"__ISINSERT__", *kOOUpdate = @"__ISUPDATE__", *kOOExecSQL = @"__OOEXEC__";
+static NSString *kOOObject = @"__OOOBJECT__", *kOOInsert = @"__ISINSERT__", *kOOUpdate = @"__ISUPDATE__", *kOOExecSQL = @"__OOEXEC__",
+	*kOOUpsert = @"__ISUPSERT__", *kOOReplace = @"__ISREPLACE__", *kOOChanges = @"__OOCHANGES__",
+	*kOOIvars = @"__OOIVARS__", *kOOHeld = @"__OOHELD__";
+
+// plan entries of the columns changed since update: for classes with +ooTracksChanges
+static char kOOChangesKey;
+
+static void ooMarkChanged( id record, int p ) {
+	[(NSMutableIndexSet *)objc_getAssociatedObject( record, &kOOChangesKey ) addIndex:p];
+}
+
+// bytes of an ivar compared to find columns with a tracking setter that were assigned directly
+static size_t ooIvarSize( char type ) {
+	switch ( type ) {
+		case 'c': case 'C': return sizeof (char);
+		case 's': case 'S': return sizeof (short);
+		case 'i': case 'l': case 'I': case 'L': return sizeof (int);
+		case 'q': case 'Q': return sizeof (long long);
+		case 'f': return sizeof (float);
+		case 'd': return sizeof (double);
+		default: return sizeof (void *);
+	}
+}
+
+// plan entries of the ooDeferredColumns of a selected record which have not been loaded
+// and the database the record was selected from to load them
+static char kOOUnloadedKey, kOODatabaseKey;
+
+static void ooSetObjectIvar( id record, ptrdiff_t offset, id value );
 
 #pragma mark OORecord abstract superclass for records
 
@@ -86,6 +209,19 @@ static NSString *kOOObject = @"__OOOBJECT__", *kOOInsert = @"__ISINSERT__", *kOO
 - (void)indate { [[OODatabase sharedInstance] indate:self]; }
 - (void)upsert { [[OODatabase sharedInstance] upsert:self]; }
 
+/**
+ Record a change to a column of a class with +ooTracksChanges that can't be seen by
+ comparing its ivar, for example an object that has been mutated in place.
+ */
+
+- (void)changed:(NSString *)column {
+	OOMetaData *metaData = [[OODatabase sharedInstance] tableMetaDataForClass:[self class]];
+	for ( int p=0 ; p<metaData->nplan ; p++ )
+		if ( strcmp( metaData->plan[p].name, [column UTF8String] ) == 0 )
+			return ooMarkChanged( self, p );
+	OOWarn( @"-[OORecord changed:] Class %@ has no column %@", *metaData->recordClassName, column );
+}
+
 - (int)commit { return [[OODatabase sharedInstance] commit]; }
 - (int)rollback { return [[OODatabase sharedInstance] rollback]; }
 
@@ -109,19 +245,86 @@ static NSString *kOOObject = @"__OOOBJECT__", *kOOInsert = @"__ISINSERT__", *kOO
 	return [[OODatabase sharedInstance] select:nil intoClass:self joinFrom:parent];
 }
 
++ (OOArray<OOArray<id> >)selectRecordsRelatedToArray:(const OOArray<id> &)parents {
+	return [[OODatabase sharedInstance] select:nil intoClass:self joinFromArray:parents];
+}
+
+/**
+ Select a page of records in ooOrderBy order starting after the last record of the
+ previous page (nil for the first) or at an offset. Pages after a record are found
+ by key rather than by counting past the rows before them so they remain fast deep
+ into a large table.
+ */
+
++ (OOArray<id>)selectPage:(int)limit after:(id)record {
+	return [[OODatabase sharedInstance] selectPageOf:self joinFrom:nil after:record limit:limit];
+}
+
++ (OOArray<id>)selectPage:(int)limit offset:(int)offset {
+	return [[OODatabase sharedInstance] selectPageOf:self joinFrom:nil offset:offset limit:limit];
+}
+
++ (long long)estimatedCount {
+	return [[OODatabase sharedInstance] estimatedCountOf:self];
+}
+
+/**
+ Aggregates of the ivars of all records of a class computed by the database without
+ creating the records. Use the OODatabase methods to restrict them to the records
+ related to a parent.
+ */
+
++ (long long)count {
+	return [[OODatabase sharedInstance] countOf:self joinFrom:nil];
+}
+
++ (double)sum:(cOOString)column {
+	return [[OODatabase sharedInstance] aggregate:"total" of:column inClass:self joinFrom:nil];
+}
+
++ (double)min:(cOOString)column {
+	return [[OODatabase sharedInstance] aggregate:"min" of:column inClass:self joinFrom:nil];
+}
+
++ (double)max:(cOOString)column {
+	return [[OODatabase sharedInstance] aggregate:"max" of:column inClass:self joinFrom:nil];
+}
+
++ (double)avg:(cOOString)column {
+	return [[OODatabase sharedInstance] aggregate:"avg" of:column inClass:self joinFrom:nil];
+}
+
++ (OOReference<OOResultSet *>)aggregate:(cOOString)expressions groupBy:(cOOString)columns {
+	return [[OODatabase sharedInstance] aggregate:expressions inClass:self groupBy:columns joinFrom:nil];
+}
+
+/**
+ Records matching a full text query on the columns named by +ooFullTextColumns, best first.
+ */
+
++ (OOArray<id>)search:(cOOString)query {
+	return [[OODatabase sharedInstance] search:query intoClass:self limit:-1];
+}
+
 - (OOArray<id>)select {
 	return [[OODatabase sharedInstance] select:nil intoClass:[self class] joinFrom:self];
 }
 
++ (OOCursor<id>)cursor {
+	return [[OODatabase sharedInstance] cursor:nil intoClass:self joinFrom:nil];
+}
+
++ (OOCursor<id>)cursorRelatedTo:(id)parent {
+	return [[OODatabase sharedInstance] cursor:nil intoClass:self joinFrom:parent];
+}
+
 /**
  import a flat file with column values separated by the delimiter specified into 
  the table associated with this class.
  */
 
 + (int)importFrom:(OOFile &)file delimiter:(cOOString)delim {
-	OOArray<id> rows = [OOMetaData import:file.string() intoClass:self delimiter:delim];
-	[[OODatabase sharedInstance] insertArray:rows];
-	return [OODatabase commit];
+	return [[OODatabase sharedInstance] importFile:file.path() intoClass:self delimiter:delim];
 }
 
 /**
@@ -129,7 +332,7 @@ static NSString *kOOObject = @"__OOOBJECT__", *kOOInsert = @"__ISINSERT__", *kOO
  */
 
 + (BOOL)exportTo:(OOFile &)file delimiter:(cOOString)delim {
-	return file.save( [OOMetaData export:[self select] delimiter:delim] );
+	return [OOMetaData export:*[self cursor] toFile:file.path() delimiter:delim] >= 0;
 }
 
 /**
@@ -170,18 +373,183 @@ static NSString *kOOObject = @"__OOOBJECT__", *kOOInsert = @"__ISINSERT__", *kOO
 @interface OOAdaptor : NSObject {
 	sqlite3 *db;
 	sqlite3_stmt *stmt;
-	struct _str_link { 
-		struct _str_link *next; char str[1]; 
-	} *strs;
-	OO_UNSAFE OODatabase *owner;
+	struct _ooArenaBlock {
+		struct _ooArenaBlock *next; size_t size, used; char bytes[1];
+	} *arena;
+	OOArray<id> bound;
+	OO_UNSAFE OODatabase *owner, *database;
+	OOReference<OODatabase *> status;
+	OODictionary<NSValue *> stmtCache;
+	OOStringArray stmtLRU;
+	BOOL stmtCached, arrayModule;
+	OOReference<OOSqlProfile *> profile;
+@public
+	OO_UNSAFE NSMapTable *identityMap;
+	int cacheHits, cacheMisses, cacheEvictions;
+	long bindNoCopy, bindArenaCopies, arenaMallocs;
+	BOOL transientBinds, checkedOut;
 }
 
-- initPath:(cOOString)path database:(OODatabase *)database;
+- initPath:(cOOString)path database:(OODatabase *)aDatabase;
+- initReaderFor:(OOAdaptor *)writer;
 - (BOOL)prepare:(cOOString)sql;
 
 - (BOOL)bindCols:(cOOStringArray)columns values:(cOOValueDictionary)values startingAt:(int)pno bindNulls:(BOOL)bindNulls;
 - (OOArray<id>)bindResultsIntoInstancesOfClass:(Class)recordClass metaData:(OOMetaData *)metaData;
+- (int *)newColumnMapForRow:(sqlite3_stmt *)row metaData:(OOMetaData *)metaData;
+- (id)newObjectForRow:(sqlite3_stmt *)row ofClass:(Class)recordClass
+			 metaData:(OOMetaData *)metaData columnMap:(const int *)map OO_RETURNS;
+- (BOOL)bindRecord:(id)record metaData:(OOMetaData *)metaData startingAt:(int)pno;
+- (sqlite3_stmt *)detachStatement;
+- (OOResultSet *)newResultSet;
 - (sqlite_int64)lastInsertRowID;
+- (sqlite3_blob *)openBlob:(cOOString)column table:(cOOString)table row:(sqlite3_int64)rowid writable:(BOOL)writable;
+- (BOOL)inTransaction;
+- (int)totalChanges;
+- (int)parameterLimit;
+- (void)setBusyTimeout:(int)ms;
+- (void)setProfile:(OOSqlProfile *)aProfile;
+- (void)setChangeFeed:(OOChangeFeed *)aFeed;
+- (BOOL)execSql:(cOOString)sql withArrayTables:(NSMutableDictionary *)tables;
+- (BOOL)bindLine:(const char *)line length:(size_t)length delimiter:(const char *)delim metaData:(OOMetaData *)metaData;
+- (BOOL)stepRow;
+- (BOOL)stepAggregate:(sqlite3_int64 *)integer real:(double *)real;
+- (void)finishStatement;
+
+@end
+
+/**
+ Counts and timings of the statements run on a database's connections while profiling.
+ */
+
+@class OOSqlStatistics;
+
+@interface OOSqlProfile : NSObject {
+	OODictionary<OOSqlStatistics *> statistics;
+	CFMutableDictionaryRef rowCounts;
+}
+
+- (void)sql:(const char *)sql prepared:(sqlite3_int64)ns;
+- (void)countRowOf:(sqlite3_stmt *)stmt;
+- (void)sql:(const char *)sql ofStatement:(sqlite3_stmt *)stmt ran:(sqlite3_int64)ns;
+- (OODictionary<NSDictionary *>)statistics;
+- (void)reset;
+
+@end
+
+/**
+ Rowids of a table inserted, updated and deleted, coalesced so a row appears in at most one.
+ */
+
+@interface OOTableChanges : NSObject {
+@public
+	OOReference<NSMutableIndexSet *> inserted, updated, deleted;
+}
+
+- (void)row:(sqlite3_int64)rowid changedBy:(int)op;
+- (void)merge:(OOTableChanges *)changes;
+- (BOOL)isEmpty;
+
+@end
+
+/**
+ A handler waiting for the changes to a table and the changes yet to be delivered to it.
+ */
+
+@interface OOChangeSubscription : NSObject {
+@public
+	OOString tableName;
+	dispatch_queue_t queue;
+	OOChangeHandler handler;
+	OOReference<OOTableChanges *> waiting;
+}
+
+- initTable:(cOOString)aTableName queue:(dispatch_queue_t)aQueue handler:(OOChangeHandler)aHandler;
+- (void)deliver:(OOTableChanges *)changes;
+
+@end
+
+/**
+ Changes collected by the update hook of the writer connection for subscribed tables.
+ The commit hook stages them as the transaction commits and they are delivered once the
+ commit has succeeded or dropped if the transaction rolls back instead.
+ */
+
+@interface OOChangeFeed : NSObject {
+@public
+	OOArray<OOChangeSubscription *> subscriptions;
+	OODictionary<OOTableChanges *> pending, staged;
+	OO_UNSAFE OOTableChanges *lastChanges;
+	char lastTable[128];
+}
+
+- (void)row:(sqlite3_int64)rowid ofTable:(const char *)table changedBy:(int)op;
+- (void)stage;
+- (void)publish;
+- (void)discard;
+
+@end
+
+/**
+ An array of records made available as a virtual table by the "ooarray" module.
+ Columns are the planned ivars of the record class other than rowid.
+ */
+
+@interface OOArrayTable : NSObject {
+@public
+	OOArray<id> records;
+	OOMetaData *metaData;
+	OOString schema;
+	int ncolumns, *columnPlan;
+}
+
+- initArray:(const OOArray<id> &)anArray metaData:(OOMetaData *)aMetaData;
+- (BOOL)isIndexed:(int)column;
+- (NSMutableDictionary *)newIndexForColumn:(int)column;
+- (void)result:(sqlite3_context *)context column:(int)column row:(NSUInteger)row;
+
+@end
+
+@interface OODatabase ()
+- (void)publishCommittedChanges;
+@end
+
+/**
+ Scoped lock serialising use of the writer connection and pending transaction. It is
+ recursive like @synchronized so writes can be nested inside other writes. Changes staged
+ by commits are published as the outermost lock is released.
+ */
+
+class OOWriterLock {
+	OO_UNSAFE OODatabase *database;
+public:
+	oo_inline OOWriterLock( OODatabase *database ) {
+		objc_sync_enter( this->database = database );
+		if ( database->writerDepth++ == 0 )
+			database->writerThread = [NSThread currentThread];
+	}
+	oo_inline ~OOWriterLock() {
+		if ( --database->writerDepth == 0 ) {
+			database->writerThread = nil;
+			[database publishCommittedChanges];
+		}
+		objc_sync_exit( database );
+	}
+};
+
+/**
+ Operations of one call to commitAsync: with its outcome once the group is committed.
+ */
+
+@interface OOCommitRequest : NSObject {
+@public
+	OOArray<OOValueDictionary > transaction;
+	OOCommitCompletion completion;
+	int updated, errcode;
+	OOString errmsg;
+}
+
+- initTransaction:(const OOArray<OOValueDictionary > &)aTransaction completion:(OOCommitCompletion)aCompletion;
 
 @end
 
@@ -234,6 +602,12 @@ static OOReference<OODatabase *> sharedInstance;
 + (OOArray<id>)select:(cOOString)select {
 	return [[self sharedInstance] select:select intoClass:nil joinFrom:nil];
 }
++ (OOArray<OOArray<id> >)select:(cOOString)select intoClass:(Class)recordClass joinFromArray:(const OOArray<id> &)parents {
+	return [[self sharedInstance] select:select intoClass:recordClass joinFromArray:parents];
+}
++ (OOCursor<id>)cursor:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent {
+	return [[self sharedInstance] cursor:select intoClass:recordClass joinFrom:parent];
+}
 
 + (int)insertArray:(const OOArray<id> &)objects { return [[self sharedInstance] insertArray:objects]; }
 + (int)deleteArray:(const OOArray<id> &)objects { return [[self sharedInstance] deleteArray:objects]; }
@@ -248,6 +622,7 @@ static OOReference<OODatabase *> sharedInstance;
 + (int)commit { return [[self sharedInstance] commit]; }
 + (int)rollback { return [[self sharedInstance] rollback]; }
 + (int)commitTransaction { return [[OODatabase sharedInstance] commitTransaction]; }
++ (void)commitAsync:(OOCommitCompletion)completion { [[self sharedInstance] commitAsync:completion]; }
 
 /**
  Designated initialiser for OODatabase instances. Generally only the shared instance is used
@@ -255,11 +630,243 @@ static OOReference<OODatabase *> sharedInstance;
  */
 
 - initPath:(cOOString)path {
-	if ( self = [super init] )
+	if ( self = [super init] ) {
 		OO_RELEASE( adaptor = [[OOAdaptor alloc] initPath:path database:self] );
+		OO_RELEASE( metaDataLock = [[NSObject alloc] init] );
+		groupCommitWindow = OOSQL_GROUP_COMMIT_WINDOW;
+	}
 	return self;
 }
 
+/**
+ Opt in to concurrent use from multiple threads. The database is switched to WAL journaling
+ and "count" read-only connections are opened. Selects and cursors check a reader out of
+ the pool for the duration of the operation so they proceed in parallel with each other
+ and with commits on the writer connection. A thread which has begun a transaction on the
+ writer, for example with exec:@"BEGIN", continues to read from it until it commits or rolls
+ back so it sees its own uncommitted changes. A read waits at most OOSQL_BUSY_TIMEOUT ms for
+ a reader, after which it is made on the writer.
+ */
+
+- (BOOL)enableConcurrentReaders:(int)count {
+	OOWriterLock writer( self );
+	if ( readersIdle || count <= 0 )
+		return NO;
+
+	if ( !([self stringForSql:@"PRAGMA journal_mode=WAL"] == "wal") ) {
+		OOWarn( @"-[OODatabase enableConcurrentReaders:] Could not enable WAL journaling - %s", errmsg );
+		return NO;
+	}
+
+	[*adaptor setBusyTimeout:OOSQL_BUSY_TIMEOUT];
+	for ( int i=0 ; i<count ; i++ ) {
+		OOAdaptor *reader = [[OOAdaptor alloc] initReaderFor:*adaptor];
+		if ( !reader )
+			break;
+		reader->identityMap = *identityMap;
+		[reader setProfile:profiling ? *profile : nil];
+		// array tables already created are made available on the new reader
+		for ( NSString *name in [*arrayTables allKeys] )
+			[reader execSql:OOFormat( @"create virtual table temp.%@ using ooarray", name ) withArrayTables:*arrayTables];
+		readers += reader;
+		OO_RELEASE( reader );
+	}
+
+	if ( !readers )
+		return NO;
+
+	readersIdle = dispatch_semaphore_create( (int)readers );
+	return YES;
+}
+
+/**
+ Opt in to sharing record instances between selects. Records are mapped by class and
+ their ooTableKey columns or otherwise rowid and held weakly so a row is only hydrated
+ again after its last instance has been released.
+ */
+
+- (void)enableIdentityMap:(BOOL)enable {
+	OOWriterLock writer( self );
+	identityMap = enable ? [NSMapTable strongToWeakObjectsMapTable] : nil;
+	adaptor->identityMap = *identityMap;
+	for ( OOAdaptor *reader in *readers )
+		reader->identityMap = *identityMap;
+}
+
+/**
+ Opt in to timing every statement run on the writer and reader connections.
+ Turning profiling off stops timing but keeps the statistics collected so far
+ until profiling is enabled again.
+ */
+
+- (void)enableProfiling:(BOOL)enable {
+	OOWriterLock writer( self );
+	if ( enable == profiling )
+		return;
+
+	if ( (profiling = enable) )
+		OO_RELEASE( profile = [[OOSqlProfile alloc] init] );
+	OOSqlProfile *active = enable ? *profile : nil;
+	[*adaptor setProfile:active];
+	for ( OOAdaptor *reader in *readers )
+		[reader setProfile:active];
+}
+
+- (void)invalidateIdentityMap {
+	if ( !!identityMap )
+		@synchronized( *identityMap ) {
+			[*identityMap removeAllObjects];
+		}
+}
+
+/**
+ Call a handler on a queue (the main queue if NULL) with the rowids of the rows of the table
+ of a class changed by each commit. Returns an object to pass to unsubscribe: to stop.
+ Rows deleted by "insert or replace" are not reported by sqlite's update hook.
+ */
+
+- (id)subscribeToChangesOf:(Class)recordClass queue:(dispatch_queue_t)queue handler:(OOChangeHandler)handler {
+	OOWriterLock writer( self );
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+
+	if ( !changeFeed ) {
+		OO_RELEASE( changeFeed = [[OOChangeFeed alloc] init] );
+		[*adaptor setChangeFeed:*changeFeed];
+	}
+
+	OOChangeSubscription *subscription = [[OOChangeSubscription alloc] initTable:metaData->tableName
+		queue:queue ? queue : dispatch_get_main_queue() handler:handler];
+	changeFeed->subscriptions += subscription;
+	return OO_AUTORELEASE( subscription );
+}
+
+- (void)unsubscribe:(id)subscription {
+	OOWriterLock writer( self );
+	if ( !changeFeed )
+		return;
+
+	changeFeed->subscriptions -= subscription;
+	if ( (int)changeFeed->subscriptions == 0 ) {
+		[*adaptor setChangeFeed:nil];
+		changeFeed = nil;
+	}
+}
+
+/**
+ Deliver the changes staged by the commit hook once the writer is no longer in the
+ transaction, that is the commit succeeded. A commit failing with SQLITE_BUSY leaves
+ the transaction open and its changes staged until it is retried or rolled back.
+ */
+
+- (void)publishCommittedChanges {
+	if ( !!changeFeed && ![*adaptor inTransaction] )
+		[*changeFeed publish];
+}
+
+/**
+ Make an array of records of a class available to SQL as the read-only virtual table
+ temp.name on the writer and reader connections. The table reads the array as it is
+ when queried rather than a copy so it should not be changed while a query is running.
+ Equality constraints on upper case (indexed) columns are passed to the table which
+ looks the rows up in an index built the first time the query uses the column.
+ */
+
+- (BOOL)createTable:(cOOString)name overArray:(const OOArray<id> &)records ofClass:(Class)recordClass {
+	OOWriterLock writer( self );
+	if ( !arrayTables )
+		arrayTables = [NSMutableDictionary dictionary];
+
+	OOArrayTable *table = [[OOArrayTable alloc] initArray:records metaData:[OOMetaData metaDataForClass:recordClass]];
+	@synchronized( *arrayTables ) {
+		[*arrayTables setObject:table forKey:[*name lowercaseString]];
+	}
+	OO_RELEASE( table );
+
+	OOString sql = OOFormat( @"create virtual table temp.%@ using ooarray", *name );
+	BOOL created = [*adaptor execSql:sql withArrayTables:*arrayTables];
+	for ( OOAdaptor *reader in *readers )
+		created &= [reader execSql:sql withArrayTables:*arrayTables];
+	return created;
+}
+
+- (BOOL)dropArrayTable:(cOOString)name {
+	OOWriterLock writer( self );
+	// the module is registered with the dictionary of tables so it must exist first
+	if ( !arrayTables )
+		return YES;
+
+	OOString sql = OOFormat( @"drop table if exists temp.%@", *name );
+	BOOL dropped = [*adaptor execSql:sql withArrayTables:*arrayTables];
+	for ( OOAdaptor *reader in *readers )
+		dropped &= [reader execSql:sql withArrayTables:*arrayTables];
+
+	@synchronized( *arrayTables ) {
+		[*arrayTables removeObjectForKey:[*name lowercaseString]];
+	}
+	return dropped;
+}
+
+/**
+ Connection to use for a read. Without a reader pool this is the writer connection.
+ */
+
+- (OOAdaptor *)checkoutReader {
+	if ( !readersIdle )
+		return *adaptor;
+
+	// only this thread can have set writerThread or transactionThread to itself. A thread
+	// which began a transaction with exec: owns it until it commits or rolls back.
+	NSThread *thread = [NSThread currentThread];
+	if ( (writerThread == thread || transactionThread == thread) && [*adaptor inTransaction] ) {
+		objc_sync_enter( self );
+		return *adaptor;
+	}
+
+	// a thread holding every reader in open cursors would otherwise wait for itself
+	if ( dispatch_semaphore_wait( readersIdle, dispatch_time( DISPATCH_TIME_NOW,
+											(int64_t)OOSQL_BUSY_TIMEOUT * NSEC_PER_MSEC ) ) != 0 ) {
+		OOWarn( @"-[OODatabase checkoutReader] No reader available after %dms, reading on the writer", OOSQL_BUSY_TIMEOUT );
+		objc_sync_enter( self );
+		return *adaptor;
+	}
+
+	@synchronized( *readers ) {
+		for ( OOAdaptor *reader in *readers )
+			if ( !reader->checkedOut ) {
+				reader->checkedOut = YES;
+				return reader;
+			}
+	}
+
+	OOWarn( @"-[OODatabase checkoutReader] No reader available" );
+	return nil;
+}
+
+- (void)checkinReader:(OOAdaptor *)reader {
+	if ( !readersIdle )
+		return;
+
+	if ( reader == *adaptor ) {
+		objc_sync_exit( self );
+		return;
+	}
+
+	@synchronized( *readers ) {
+		reader->checkedOut = NO;
+	}
+	dispatch_semaphore_signal( readersIdle );
+}
+
+- (void)dealloc {
+#ifndef OO_ARC
+	if ( readersIdle )
+		dispatch_release( readersIdle );
+	if ( writerQueue )
+		dispatch_release( writerQueue );
+#endif
+	OO_DEALLOC( super );
+}
+
 /**
  Automatically register all classes which are subclasses of a record abstract superclass (e.g. OORecord).
  */
@@ -308,33 +915,256 @@ static OOReference<OODatabase *> sharedInstance;
 }
 
 /**
- Send any SQL to the database. Sql is a format string so escape any '%' characters using '%%'.
- Any results returned are placed as an array of dictionary values in the database->results.
+ Does sql create, drop or alter something making any names read from sqlite_master stale?
  */
- 
-- (BOOL)exec:(NSString *)fmt, ... {
-	va_list argp; va_start(argp, fmt);
-	NSString *sql = [[NSString alloc] initWithFormat:fmt arguments:argp];
-	va_end( argp );
-	results = [self select:sql intoClass:NULL joinFrom:nil];
-	OO_RELEASE( sql );
-	return !errcode;
+
+static BOOL ooIsSchemaChange( NSString *sql ) {
+	const char *ptr = [sql UTF8String];
+	while ( isspace( (unsigned char)*ptr ) )
+		ptr++;
+	return strncasecmp( ptr, "create", 6 ) == 0 || strncasecmp( ptr, "drop", 4 ) == 0 ||
+		strncasecmp( ptr, "alter", 5 ) == 0;
 }
 
 /**
- Return a single value from row 1, column one from sql sent to the database as a string.
+ Run sql on the writer returning any results. Used by exec: and, through
+ internalResultsForSql:, by queries the database makes for itself.
  */
 
-- (OOString)stringForSql:(NSString *)fmt, ... {
-	va_list argp; va_start(argp, fmt);
-	NSString *sql = OO_AUTORELEASE( [[NSString alloc] initWithFormat:fmt arguments:argp] );
-	va_end( argp );
-	if( [self exec:@"%@", sql] && results > 0 ) {
-		NSString *aColumnName = [[**results[0] allKeys] objectAtIndex:0];
-		return [(NSNumber *)(*results[0])[aColumnName] stringValue];
-	}
-	else
-		return nil;
+- (OOReference<OOResultSet *>)resultsForSql:(cOOString)sql {
+	OOWriterLock writer( self );
+	BOOL schemaChange = ooIsSchemaChange( *sql );
+	if ( schemaChange )
+		schemaNames = nil;
+	int changes = [*adaptor totalChanges];
+	BOOL wasInTransaction = [*adaptor inTransaction];
+	OOReference<OOResultSet *> out;
+	if ( [self prepareSql:sql joinFrom:nil toTable:[self tableMetaDataForClass:nil]] )
+		OO_RELEASE( *(out = [*adaptor newResultSet]) );
+	// records cached by the identity map may no longer match the rows
+	if ( schemaChange || [*adaptor totalChanges] != changes )
+		[self invalidateIdentityMap];
+	// selects by the thread which began a transaction read from the writer until it ends
+	if ( [*adaptor inTransaction] != wasInTransaction )
+		transactionThread = wasInTransaction ? nil : [NSThread currentThread];
+	return out;
+}
+
+/**
+ Run a query for the database itself leaving the results, resultSet, errcode, errmsg
+ and lastSQL of the caller's last exec: as they were. Returns nil if there was an error.
+ */
+
+- (OOReference<OOResultSet *>)internalResultsForSql:(cOOString)sql {
+	OOWriterLock writer( self );
+	int savedErrcode = errcode;
+	char *savedErrmsg = errmsg;
+	OOString savedSQL = lastSQL;
+	OOReference<OOResultSet *> out = [self resultsForSql:sql];
+	if ( errcode )
+		out = nil;
+	errcode = savedErrcode;
+	errmsg = savedErrmsg;
+	lastSQL = savedSQL;
+	return out;
+}
+
+/**
+ Send any SQL to the database. Sql is a format string so escape any '%' characters using '%%'.
+ Any results returned are placed in an OOResultSet in the database->resultSet. The same
+ object is also in database->results as an array of its rows bridged to dictionaries.
+ */
+ 
+- (BOOL)exec:(NSString *)fmt, ... {
+	va_list argp; va_start(argp, fmt);
+	OOString sql = OO_AUTORELEASE( [[NSString alloc] initWithFormat:fmt arguments:argp] );
+	va_end( argp );
+	OOWriterLock writer( self );
+	resultSet = [self resultsForSql:sql];
+	results = (id)*resultSet;
+	return !errcode;
+}
+
+/**
+ Does the table or index name exist in the database? The names in sqlite_master are
+ read once and kept until exec: is next used to create, drop or alter something.
+ */
+
+- (BOOL)schemaContains:(cOOString)name {
+	OOWriterLock writer( self );
+	if ( !schemaNames ) {
+		OOReference<NSMutableSet *> names = [NSMutableSet set];
+		OOReference<OOResultSet *> master = [self internalResultsForSql:"select name from sqlite_master"];
+		if ( !!master )
+			for ( int r=0 ; r<master->nrows ; r++ )
+				[*names addObject:[[*master stringForRow:r column:0] lowercaseString]];
+		schemaNames = names;
+	}
+	return [*schemaNames containsObject:[*name lowercaseString]];
+}
+
+/**
+ Return a single value from row 1, column one from sql sent to the database as a string.
+ The results and errcode of the last exec: are left as they were.
+ */
+
+- (OOString)stringForSql:(NSString *)fmt, ... {
+	va_list argp; va_start(argp, fmt);
+	NSString *sql = OO_AUTORELEASE( [[NSString alloc] initWithFormat:fmt arguments:argp] );
+	va_end( argp );
+	OOReference<OOResultSet *> value = [self internalResultsForSql:sql];
+	if ( !!value && value->nrows > 0 && value->ncols > 0 )
+		return [*value stringForRow:0 column:0];
+	else
+		return nil;
+}
+
+/**
+ Find the offsets of unescaped newlines between two offsets of a file in parallel.
+ */
+
+static size_t *ooFindLineEnds( const char *base, size_t from, size_t to, size_t *count ) {
+	size_t nchunks = MAX( 1, MIN( [[NSProcessInfo processInfo] activeProcessorCount] * 4, (to-from) / 65536 ) ),
+		chunk = (to-from + nchunks-1) / nchunks, **found = (size_t **)calloc( nchunks, sizeof *found ),
+		*nfound = (size_t *)calloc( nchunks, sizeof *nfound );
+
+	dispatch_apply( nchunks, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^( size_t c ) {
+		const char *ptr = base + from + c*chunk, *end = base + MIN( from + (c+1)*chunk, to );
+		size_t capacity = 0, n = 0, *ends = NULL;
+
+		while ( ptr < end && (ptr = (const char *)memchr( ptr, '\n', end-ptr )) ) {
+			if ( ptr == base || ptr[-1] != '\\' ) {
+				if ( n == capacity )
+					ends = (size_t *)realloc( ends, (capacity = capacity ? capacity*2 : 1024) * sizeof *ends );
+				ends[n++] = ptr - base;
+			}
+			ptr++;
+		}
+
+		found[c] = ends;
+		nfound[c] = n;
+	} );
+
+	size_t total = 0, *ends;
+	for ( size_t c=0 ; c<nchunks ; c++ )
+		total += nfound[c];
+
+	ends = (size_t *)malloc( (total+1) * sizeof *ends );
+	*count = 0;
+	for ( size_t c=0 ; c<nchunks ; c++ ) {
+		memcpy( ends + *count, found[c], nfound[c] * sizeof *ends );
+		*count += nfound[c];
+		free( found[c] );
+	}
+
+	free( found );
+	free( nfound );
+	return ends;
+}
+
+/**
+ Import a flat file of delimited values in the format written by export: into the table for
+ a class. The file is memory mapped and searched for line ends a window at a time in parallel.
+ The fields of each line are then parsed in place and bound into one reused prepared insert
+ inside a single transaction. Classes with accessor methods for their columns are imported
+ by creating records as before so the accessors are still called.
+ */
+
+- (int)importFile:(cOOString)path intoClass:(Class)recordClass delimiter:(cOOString)delim {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+	BOOL direct = metaData->plan != NULL;
+	for ( int p=0 ; p<metaData->nplan ; p++ )
+		if ( !metaData->plan[p].rowid && !(metaData->plan[p].setDirect && metaData->plan[p].getDirect) )
+			direct = NO;
+
+	if ( !direct ) {
+		OOWriterLock writer( self );
+		NSTimeInterval started = [NSDate timeIntervalSinceReferenceDate];
+		[self insertArray:[OOMetaData import:OOFile( path ).string() intoClass:recordClass delimiter:delim]];
+		importedRows = [self commit];
+		importFailures = 0;
+		importSeconds = [NSDate timeIntervalSinceReferenceDate] - started;
+		return importedRows;
+	}
+
+	struct stat st;
+	int fd = open( [*path fileSystemRepresentation], O_RDONLY );
+	if ( fd < 0 || fstat( fd, &st ) != 0 ) {
+		OOWarn( @"-[OODatabase importFile:...] Could not open: %@", *path );
+		if ( fd >= 0 )
+			close( fd );
+		return 0;
+	}
+
+	size_t size = (size_t)st.st_size;
+	const char *base = size ? (const char *)mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 ) : NULL;
+	close( fd );
+	if ( base == MAP_FAILED ) {
+		OOWarn( @"-[OODatabase importFile:...] Could not map: %@", *path );
+		return 0;
+	}
+	if ( base )
+		madvise( (void *)base, size, MADV_SEQUENTIAL );
+
+	OOWriterLock writer( self );
+	NSTimeInterval started = [NSDate timeIntervalSinceReferenceDate];
+	OOString sql = OOFormat( @"insert into %@ (%@) values (?%@)", *metaData->tableName,
+							*(metaData->columns/", "), *(OOString( ", ?" ) * ((int)metaData->columns-1)) );
+	const char *sep = [*delim UTF8String];
+	int imported = 0, failed = 0;
+
+	BOOL implicit = ![*adaptor inTransaction];
+	if ( implicit )
+		[self exec:@"BEGIN TRANSACTION"];
+
+	if ( size && [*adaptor prepare:sql] ) {
+		size_t window = OOSQL_IMPORT_WINDOW, pos = 0;
+
+		while ( pos < size ) {
+			size_t end = MIN( pos + window, size ), nlines;
+			size_t *lines = ooFindLineEnds( base, pos, end, &nlines );
+
+			if ( nlines == 0 && end < size ) {
+				free( lines );
+				window *= 2;
+				continue;
+			}
+
+			// a last line without a newline
+			if ( end == size && (nlines == 0 || lines[nlines-1] != size-1) )
+				lines[nlines++] = size;
+
+			@autoreleasepool {
+				for ( size_t l=0 ; l<nlines ; l++ ) {
+					if ( lines[l] > pos ) {
+						if ( [*adaptor bindLine:base+pos length:lines[l]-pos delimiter:sep metaData:metaData] &&
+							[*adaptor stepRow] )
+							imported++;
+						else
+							failed++;
+					}
+					pos = lines[l] + 1;
+				}
+			}
+
+			free( lines );
+		}
+
+		[*adaptor finishStatement];
+	}
+
+	if ( implicit && ![self exec:@"COMMIT"] )
+		OOWarn( @"-[OODatabase importFile:...] Error committing import - %s", errmsg );
+
+	if ( base )
+		munmap( (void *)base, size );
+
+	if ( imported )
+		[self invalidateIdentityMap];
+	importedRows = imported;
+	importFailures = failed;
+	importSeconds = [NSDate timeIntervalSinceReferenceDate] - started;
+	return imported;
 }
 
 /**
@@ -372,17 +1202,45 @@ static OOReference<OODatabase *> sharedInstance;
 	return out;
 }
 
+/**
+ Columns identifying the row to update or delete: the rowid if the record has a rowid ivar
+ that has been populated, the ooTableKey columns if none of them are null or, for tables
+ without a key, all columns.
+ */
+
+- (OOStringArray)keyColumnsFor:(OOMetaData *)metaData values:(cOOValueDictionary)values {
+	// encode: stores a nil object rowid as OONull which has no longLongValue
+	id rowid = !!metaData->rowidColumn ? *values[metaData->rowidColumn] : nil;
+	if ( rowid && rowid != OONull && [(NSNumber *)rowid longLongValue] )
+		return OOStringArray( *metaData->rowidColumn, nil );
+
+	if ( !!metaData->keys ) {
+		// encode: stores null values as OONull
+		BOOL nullKey = NO;
+		for ( NSString *key in *metaData->keys )
+			nullKey |= !values[key] || *values[key] == OONull;
+		if ( !nullKey )
+			return metaData->keys;
+	}
+
+	return metaData->columns;
+}
+
 /**
  Prepare the sql passed in adding a where clause with bindings for a join to values taken from the parent record.
  */
 
 - (BOOL)prepareSql:(OOString &)sql joinFrom:(id)parent toTable:(OOMetaData *)metaData {
+	return [self prepareSql:sql joinFrom:parent toTable:metaData adaptor:*adaptor];
+}
+
+- (BOOL)prepareSql:(OOString &)sql joinFrom:(id)parent toTable:(OOMetaData *)metaData adaptor:(OOAdaptor *)conn {
 	OOValueDictionary joinValues;
 	OOStringArray sharedColumns;
 
 	if ( parent ) {
 		OOMetaData *parentMetaData = [self tableMetaDataForClass:[parent class]];
-		sharedColumns = [parentMetaData naturalJoinTo:metaData->joinableColumns];
+		sharedColumns = [parentMetaData naturalJoinToTable:metaData];
 		joinValues = [parentMetaData encode:[[parent dictionaryWithValuesForKeys:sharedColumns] mutableCopy]];
 
 		sql += [self whereClauseFor:sharedColumns values:joinValues qualifyNulls:NO];
@@ -395,10 +1253,10 @@ static OOReference<OODatabase *> sharedInstance;
 	NSLog( @"-[OOMetaData prepareSql:] %@\n%@", *sql, *joinValues );
 #endif
 
-	if ( ![*adaptor prepare:sql] )
+	if ( ![conn prepare:sql] )
 		return NO;
 
-	return !parent || [*adaptor bindCols:sharedColumns values:joinValues startingAt:1 bindNulls:NO];
+	return !parent || [conn bindCols:sharedColumns values:joinValues startingAt:1 bindNulls:NO];
 }
 
 /**
@@ -411,489 +1269,3534 @@ static OOReference<OODatabase *> sharedInstance;
 	OOMetaData *metaData = [record class] == [OOMetaData class] ? 
         record : [self tableMetaDataForClass:[record class]];
 
-	OOStringArray tablesWithNaturalJoin;
-	tablesWithNaturalJoin <<= metaData->tablesWithNaturalJoin;
-
-	if ( record && record != metaData )
-		for ( int i=0 ; i<tablesWithNaturalJoin ; i++ ) {
-			OOString sql = OOFormat( @"select count(*) as result from %@", **tablesWithNaturalJoin[i] );
-			OOMetaData *childMetaData = tableMetaDataByClassName[tablesWithNaturalJoin[i]];
-
-			[self prepareSql:sql joinFrom:record toTable:childMetaData];
-			OOArray<OODictionary<NSNumber *> > tmpResults = [*adaptor bindResultsIntoInstancesOfClass:NULL metaData:nil];
-
-			if ( ![(*tmpResults[0])["result"] intValue] )
-				~tablesWithNaturalJoin[i--];
+	if ( !record || record == metaData )
+		@synchronized( *metaDataLock ) {
+			return tableMetaDataByClassName[+metaData->tablesWithNaturalJoin];
 		}
 
-	return tableMetaDataByClassName[+tablesWithNaturalJoin];
+	return *[self tablesRelatedByNaturalJoinFromArray:OOArray<id>( record, nil )][0];
 }
 
 /**
- Perform a select from a table on the database using either the sql specified 
- orselect all columns from the table associated with the record class passed in.
- If a parent is passed in make a natural join from that record.
+ Determine which related tables have rows joining to each of an array of records of the
+ same class. Rather than counting the rows of each table separately, this is answered by
+ "union all" of an "exists" test for each record and table in as few queries as the
+ limits on parameters and compound selects allow.
  */
 
-- (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent {
-	OOMetaData *metaData = [self tableMetaDataForClass:recordClass ? recordClass : [parent class]];
-	OOString sql = !select ?
-        OOFormat( @"select %@\nfrom %@", *(metaData->outcols/", "), *metaData->tableName ) : *select;
+- (OOArray<OOArray<OOMetaData *> >)tablesRelatedByNaturalJoinFromArray:(const OOArray<id> &)records {
+	OOArray<OOArray<OOMetaData *> > out;
+	if ( !records )
+		return out;
 
-	if ( ![self prepareSql:sql joinFrom:parent toTable:metaData] )
-		return nil;
+	OOMetaData *metaData = [self tableMetaDataForClass:[records[0] class]];
+	OOArray<OOMetaData *> tables;
+	@synchronized( *metaDataLock ) {
+		tables = tableMetaDataByClassName[+metaData->tablesWithNaturalJoin];
+	}
+	int nrecords = records, ntables = tables;
+	BOOL *exists = (BOOL *)calloc( nrecords * ntables + 1, sizeof *exists );
+
+	OOAdaptor *conn = [self checkoutReader];
+	int maxParameters = [conn parameterLimit], r = 0, t = 0;
+
+	while ( r < nrecords && ntables ) {
+		OOString sql;
+		OOStringArray bindColumns;
+		OOValueDictionary bindValues;
+		int nterms = 0, nparameters = 0;
+
+		// sqlite's default limit on compound selects is 500
+		for ( ; r < nrecords && nterms < 500 ; t = 0, r++ ) {
+			OOValueDictionary values = [metaData encodeRecord:*records[r]];
+
+			for ( ; t < ntables && nterms < 500 ; t++ ) {
+				OOMetaData *table = *tables[t];
+				OOStringArray bound;
+				for ( NSString *name in *[metaData naturalJoinToTable:table] )
+					if ( *values[name] != OONull )
+						bound += name;
+
+				if ( nterms && nparameters + (int)bound > maxParameters )
+					break;
 
-	return [*adaptor bindResultsIntoInstancesOfClass:recordClass metaData:metaData];
-}
+				sql += OOFormat( @"%@select %d where exists (select 1 from %@%@)", nterms++ ? @"\nunion all " : @"",
+								r * ntables + t, *table->tableName,
+								*[self whereClauseFor:bound values:values qualifyNulls:NO] );
 
-- (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass {
-	return [self select:select intoClass:recordClass joinFrom:nil];
-}
+				// parameters are bound by position so give each its own name
+				for ( NSString *name in *bound ) {
+					OOString key = OOFormat( @"%d", nparameters++ );
+					bindColumns += key;
+					bindValues[key] = *values[name];
+				}
+			}
 
-- (OOArray<id>)select:(cOOString)select {
-	return [self select:select intoClass:nil joinFrom:nil];
+			if ( t < ntables )
+				break;
+		}
+
+#ifdef OODEBUG_SQL
+		NSLog( @"-[OODatabase tablesRelatedByNaturalJoinFromArray:] %@\n%@", *sql, *bindValues );
+#endif
+
+		if ( [conn prepare:sql] && [conn bindCols:bindColumns values:bindValues startingAt:1 bindNulls:YES] ) {
+			OOResultSet *found = [conn newResultSet];
+			for ( int row=0 ; row<found->nrows ; row++ )
+				exists[[found longLongForRow:row column:0]] = YES;
+			OO_RELEASE( found );
+		}
+		else
+			break;
+	}
+
+	[self checkinReader:conn];
+
+	for ( int i=0 ; i<nrecords ; i++ ) {
+		OOArray<OOMetaData *> related;
+		related.alloc();
+		for ( int j=0 ; j<ntables ; j++ )
+			if ( exists[i * ntables + j] )
+				related += *tables[j];
+		out += related;
+	}
+
+	free( exists );
+	return out;
 }
 
 /**
- Returns sqlite3 row identifier for a record instance.
+ Columns a table is ordered by taken from ooOrderBy with rowid last so the order is
+ unique, and whether each is descending. Classes with ooTableKey columns but no rowid
+ ivar are made unique by their key columns instead so the last record's rowid need not
+ be selected. Orders which are not a list of columns of the table can not be used to
+ page by key and the table is paged in key or rowid order.
  */
 
-- (long long)rowIDForRecord:(id)record {
-	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
-	OOString sql = OOFormat( @"select ROWID from %@", *metaData->tableName );
-	OOArray<OODictionary<NSNumber *> > idResults = [self select:sql intoClass:nil joinFrom:record];
-	return [*(*idResults[0])[@"rowid"] longLongValue];
+static OOStringArray ooOrderColumns( OOMetaData *metaData, NSMutableIndexSet *descending ) {
+	OOStringArray order;
+	Class recordClass = metaData->recordClass;
+
+	if ( [recordClass respondsToSelector:@selector(ooOrderBy)] )
+		for ( NSString *term in [[recordClass ooOrderBy] componentsSeparatedByString:@","] ) {
+			OOStringArray words = OOString( [term stringByTrimmingCharactersInSet:
+											 [NSCharacterSet whitespaceAndNewlineCharacterSet]] ) / " ";
+			int nwords = words;
+			if ( nwords < 1 || nwords > 2 || ![*metaData->columns containsObject:*words[0]] ||
+				(nwords == 2 && [*words[1] caseInsensitiveCompare:@"asc"] != NSOrderedSame &&
+				 [*words[1] caseInsensitiveCompare:@"desc"] != NSOrderedSame) ) {
+				OOWarn( @"ooOrderColumns() Can not page %@ by key in order: %@", *metaData->recordClassName,
+					   [recordClass ooOrderBy] );
+				[descending removeAllIndexes];
+				order = OOStringArray();
+				break;
+			}
+
+			if ( nwords == 2 && [*words[1] caseInsensitiveCompare:@"desc"] == NSOrderedSame )
+				[descending addIndex:(int)order];
+			order += *words[0];
+		}
+
+	if ( !metaData->rowidColumn && !!metaData->keys ) {
+		for ( NSString *key in *metaData->keys )
+			if ( ![*order containsObject:key] )
+				order += key;
+	}
+	else
+		order += @"rowid";
+	return order;
 }
 
 /**
- Returns sqlite3 row identifier for last inserted record.
+ Select a page of records of a class optionally related to a parent. After a record
+ the where clause is expanded to "(a > ?) or (a = ? and b > ?) ..." over the order
+ columns so it works for any mix of ascending and descending columns. These columns,
+ including any key columns used to make the order unique, should not be null. Classes
+ with neither a rowid ivar nor ooTableKey columns can not be paged after a record as
+ their rows can not be identified. At an offset the rows before are skipped using
+ "offset". The limit and offset are bound so every page uses the same statement.
  */
 
-- (long long)lastInsertRowID {
-	return [*adaptor lastInsertRowID];
+- (OOArray<id>)selectPageOf:(Class)recordClass joinFrom:(id)parent after:(id)last offset:(int)offset limit:(int)limit {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+	OOString sql = OOFormat( @"select %@\nfrom %@", *(metaData->outcols/", "), *metaData->tableName ), prefix = "\nwhere";
+	OOStringArray bindColumns;
+	OOValueDictionary bindValues;
+
+	if ( parent ) {
+		OOMetaData *parentMetaData = [self tableMetaDataForClass:[parent class]];
+		OOStringArray shared = [parentMetaData naturalJoinToTable:metaData], bound;
+		OOValueDictionary joinValues = [parentMetaData encode:[[parent dictionaryWithValuesForKeys:shared] mutableCopy]];
+		for ( NSString *name in *shared )
+			if ( *joinValues[name] != OONull ) {
+				bound += name;
+				bindValues[OOFormat( @"%d", (int)bindColumns )] = *joinValues[name];
+				bindColumns += OOFormat( @"%d", (int)bindColumns );
+			}
+		if ( !!bound ) {
+			sql += [self whereClauseFor:bound values:joinValues qualifyNulls:NO];
+			prefix = " and";
+		}
+	}
+
+	NSMutableIndexSet *descending = [NSMutableIndexSet indexSet];
+	OOStringArray order = ooOrderColumns( metaData, descending );
+
+	if ( last && !metaData->rowidColumn && !metaData->keys ) {
+		OOWarn( @"-[OODatabase selectPageOf:...] Class %@ needs a rowid ivar or ooTableKey to page after a record",
+			   *metaData->recordClassName );
+		return nil;
+	}
+
+	if ( last ) {
+		OOValueDictionary lastValues = [metaData encodeRecord:last];
+		if ( !!metaData->rowidColumn )
+			lastValues[@"rowid"] = *lastValues[metaData->rowidColumn];
+
+		OOStringArray terms;
+		for ( int t=0 ; t<order ; t++ ) {
+			OOString term = "(";
+			for ( int o=0 ; o<=t ; o++ ) {
+				term += OOFormat( @"%@%@ %s ?", o ? @" and " : @"", **order[o],
+								 o < t ? "=" : [descending containsIndex:o] ? "<" : ">" );
+				bindValues[OOFormat( @"%d", (int)bindColumns )] = *lastValues[*order[o]];
+				bindColumns += OOFormat( @"%d", (int)bindColumns );
+			}
+			terms += term + ")";
+		}
+		sql += OOFormat( @"%@ (%@)", *prefix, *(terms/" or ") );
+	}
+
+	OOStringArray orderBy;
+	for ( int o=0 ; o<order ; o++ )
+		orderBy += OOFormat( @"%@%s", **order[o], [descending containsIndex:o] ? " desc" : "" );
+	sql += OOFormat( @"\norder by %@\nlimit ? offset ?", *(orderBy/", ") );
+	bindValues[OOFormat( @"%d", (int)bindColumns )] = [NSNumber numberWithInt:limit];
+	bindColumns += OOFormat( @"%d", (int)bindColumns );
+	bindValues[OOFormat( @"%d", (int)bindColumns )] = [NSNumber numberWithInt:offset];
+	bindColumns += OOFormat( @"%d", (int)bindColumns );
+
+#ifdef OODEBUG_SQL
+	NSLog( @"-[OODatabase selectPageOf:...] %@\n%@", *sql, *bindValues );
+#endif
+
+	OOAdaptor *conn = [self checkoutReader];
+	OOArray<id> out;
+
+	if ( [conn prepare:sql] && [conn bindCols:bindColumns values:bindValues startingAt:1 bindNulls:YES] )
+		out = [conn bindResultsIntoInstancesOfClass:recordClass metaData:metaData];
+	else
+		out = nil;
+
+	[self checkinReader:conn];
+	return out;
+}
+
+- (OOArray<id>)selectPageOf:(Class)recordClass joinFrom:(id)parent after:(id)last limit:(int)limit {
+	return [self selectPageOf:recordClass joinFrom:parent after:last offset:0 limit:limit];
+}
+
+- (OOArray<id>)selectPageOf:(Class)recordClass joinFrom:(id)parent offset:(int)offset limit:(int)limit {
+	return [self selectPageOf:recordClass joinFrom:parent after:nil offset:offset limit:limit];
 }
 
 /**
- Insert an array of record objects into the database. This needs to be commited to take effect.
+ Quick estimate of the number of rows in the table of a class from the range of its
+ rowids. This is exact unless rows have been deleted and is found without a scan.
  */
 
-- (int)insertArray:(const OOArray<id> &)objects {
-	int count = 0;
-	for ( id object in *objects )
-		count = [self insert:object];
-	return count;
+- (long long)estimatedCountOf:(Class)recordClass {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+	OOString count = [self stringForSql:@"select coalesce(max(rowid) - min(rowid) + 1, 0) from %@", *metaData->tableName];
+	return [*count longLongValue];
 }
 
 /**
- Delete an array of record objects from the database. This needs to be commited to take effect.
+ Select records using the FTS5 index of a class that has +ooFullTextColumns rather than
+ a "like" expression which has to scan the table. The query is in FTS5 syntax, words
+ or "prefix*" for example and results are ranked by bm25(). A limit of -1 returns all.
+ The index is kept up to date by triggers. sqlite doesn't fire the delete trigger for rows
+ removed by "insert or replace" unless recursive_triggers is on, so indate: deletes then
+ inserts for these classes and SQL run using exec: should do the same.
  */
 
-- (int)deleteArray:(const OOArray<id> &)objects {
-	int count = 0;
-	for ( id object in *objects )
-		if ( ![object respondsToSelector:@selector(delete)] )
-			count = [self delete:object];
-		else {
-			[object delete];
-			count++;
-		}
-	return count;
+- (OOArray<id>)search:(cOOString)query intoClass:(Class)recordClass limit:(int)limit {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+	if ( !metaData->fullTextTable ) {
+		OOWarn( @"-[OODatabase search:intoClass:limit:] Class %@ has no +ooFullTextColumns", *metaData->recordClassName );
+		return nil;
+	}
+
+	OOStringArray qualified;
+	for ( NSString *column in *metaData->outcols )
+		qualified += OOFormat( @"t.%@ as %@", column, column );
+
+	OOString sql = OOFormat( @"select %@\nfrom %@ join %@ t on t.rowid = %@.rowid\n"
+							"where %@ match ?\norder by bm25(%@)\nlimit %d",
+							*(qualified/", "), *metaData->fullTextTable, *metaData->tableName,
+							*metaData->fullTextTable, *metaData->fullTextTable, *metaData->fullTextTable, limit );
+	OOStringArray bindColumns = "query";
+	OOValueDictionary bindValues;
+	bindValues[@"query"] = *query;
+
+	OOAdaptor *conn = [self checkoutReader];
+	OOArray<id> out;
+
+	if ( [conn prepare:sql] && [conn bindCols:bindColumns values:bindValues startingAt:1 bindNulls:YES] )
+		out = [conn bindResultsIntoInstancesOfClass:recordClass metaData:metaData];
+	else
+		out = nil;
+
+	[self checkinReader:conn];
+	return out;
 }
 
 /**
- Insert the values of the record class instance at the time this method was called into the db.
- (must be commited to take effect). Returns the total number of outstanding inserts/updates/deletes.
+ Prepare "select ... from" the table of a class on a reader for the aggregate methods
+ restricted to the records related to a parent if there is one. Returns the reader which
+ must be checked in once the statement has been stepped or nil if there was an error.
  */
 
-- (int)insert:(id)record {
-	return transaction += OOValueDictionary( kOOObject, record, kOOInsert, kOOInsert, nil );
+- (OOAdaptor *)prepareAggregate:(cOOString)select metaData:(OOMetaData *)metaData
+					   joinFrom:(id)parent groupBy:(cOOStringArray)groupBy {
+	OOString sql = OOFormat( @"select %@\nfrom %@", *select, *metaData->tableName );
+	OOValueDictionary joinValues;
+	OOStringArray sharedColumns;
+
+	if ( parent ) {
+		OOMetaData *parentMetaData = [self tableMetaDataForClass:[parent class]];
+		sharedColumns = [parentMetaData naturalJoinToTable:metaData];
+		joinValues = [parentMetaData encode:OO_AUTORELEASE( [[parent dictionaryWithValuesForKeys:sharedColumns] mutableCopy] )];
+		sql += [self whereClauseFor:sharedColumns values:joinValues qualifyNulls:NO];
+	}
+
+	if ( !!groupBy )
+		sql += OOFormat( @"\ngroup by %@\norder by %@", *(groupBy/", "), *(groupBy/", ") );
+
+#ifdef OODEBUG_SQL
+	NSLog( @"-[OODatabase prepareAggregate:...] %@\n%@", *sql, *joinValues );
+#endif
+
+	OOAdaptor *conn = [self checkoutReader];
+	if ( [conn prepare:sql] && (!parent || [conn bindCols:sharedColumns values:joinValues startingAt:1 bindNulls:NO]) )
+		return conn;
+
+	[self checkinReader:conn];
+	return nil;
+}
+
+static BOOL ooIsColumn( OOMetaData *metaData, NSString *column, const char *method ) {
+	if ( [*metaData->columns containsObject:column] || [column isEqualToString:*metaData->rowidColumn] )
+		return YES;
+	OOWarn( @"%s Class %@ has no column %@", method, *metaData->recordClassName, column );
+	return NO;
 }
 
 /**
- Use the values of the record instance at the time this method is called in a where clause to 
- delete from the database when commit is called. Returns the total number of outstanding
- inserts/updates/deletes.
+ Number of records of a class, or of those related to a parent by natural join.
  */
 
-- (int)delete:(id)record {
-	return transaction += OOValueDictionary( kOOObject, record, nil );
+- (long long)countOf:(Class)recordClass joinFrom:(id)parent {
+	OOAdaptor *conn = [self prepareAggregate:"count(*)" metaData:[self tableMetaDataForClass:recordClass]
+									joinFrom:parent groupBy:OOStringArray()];
+	sqlite3_int64 count = 0;
+	[conn stepAggregate:&count real:NULL];
+	if ( conn )
+		[self checkinReader:conn];
+	return count;
 }
 
 /**
- Call this method if you intend to make changes to the record object and save them to the database.
- This takes a snapshot of the previous values to use as a key for the update operation when "commit"
- is called. Returns the total number of outstanding inserts/updates/deletes.
+ Value of an aggregate function (count, sum, total, min, max or avg) of a numeric column
+ of the records of a class or those related to a parent read directly from the statement.
+ Returns 0 if there are no records or the aggregate is null.
  */
 
-- (int)update:(id)record {
-	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
-	OOValueDictionary oldValues = [metaData encode:[[record dictionaryWithValuesForKeys:metaData->columns] mutableCopy]];
-	for ( NSString *key in *metaData->tocopy )
-		OO_RELEASE( oldValues[key] = [oldValues[key] copy] );
-	oldValues[kOOUpdate] = (id)kOOUpdate;
-	oldValues[kOOObject] = record;
-	return transaction += oldValues;
+- (double)aggregate:(cOOString)function of:(cOOString)column inClass:(Class)recordClass joinFrom:(id)parent {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+	static NSSet *functions;
+	static dispatch_once_t once;
+	dispatch_once( &once, ^{
+		functions = OO_RETAIN( [NSSet setWithObjects:@"count", @"sum", @"total", @"min", @"max", @"avg", nil] );
+	} );
+
+	if ( ![functions containsObject:[*function lowercaseString]] ) {
+		OOWarn( @"-[OODatabase aggregate:of:inClass:joinFrom:] Unknown aggregate function %@", *function );
+		return 0.;
+	}
+	if ( !ooIsColumn( metaData, *column, "-[OODatabase aggregate:of:inClass:joinFrom:]" ) )
+		return 0.;
+
+	OOAdaptor *conn = [self prepareAggregate:OOFormat( @"%@(%@)", *function, *column ) metaData:metaData
+									joinFrom:parent groupBy:OOStringArray()];
+	double value = 0.;
+	[conn stepAggregate:NULL real:&value];
+	if ( conn )
+		[self checkinReader:conn];
+	return value;
 }
 
 /**
- Inserts a record into the database the deletes any previous record with the same key.
- This ensures the record's rowid changes if this is used by child records.
+ Aggregate expressions such as "sum(qty), count(*)" for each distinct value of one or more
+ columns of a class, or those of the records related to a parent. Results are returned in
+ an OOResultSet ordered by the columns which come first followed by the expressions.
+ Values are stored unboxed and can be read using its typed accessors. The expressions are
+ trusted SQL from the program and must not come from user input. Only the check that they
+ are a single statement without comments is made.
  */
 
-- (int)indate:(id)record {
-	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
-	OOString sql = OOFormat( @"select rowid from %@", *metaData->tableName );
-	OOArray<id> existing = [self select:sql intoClass:nil joinFrom:record];
-	int count = [self insert:record];
-	for ( NSDictionary *exist in *existing ) {
-		OOString sql = OOFormat( @"delete from %@ where rowid = %ld", *metaData->tableName, 
-								(long)[[exist objectForKey:@"rowid"] longLongValue] );
-		transaction += OOValueDictionary( kOOExecSQL, *sql, nil );
+- (OOReference<OOResultSet *>)aggregate:(cOOString)expressions inClass:(Class)recordClass
+								groupBy:(cOOString)columns joinFrom:(id)parent {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass];
+	OOStringArray groupBy = columns["\\w+"];
+	OOReference<OOResultSet *> out;
+
+	for ( NSString *column in *groupBy )
+		if ( !ooIsColumn( metaData, column, "-[OODatabase aggregate:inClass:groupBy:joinFrom:]" ) )
+			return out;
+	if ( !!expressions[";|--|/\\*"] ) {
+		OOWarn( @"-[OODatabase aggregate:inClass:groupBy:joinFrom:] Invalid expressions %@", *expressions );
+		return out;
 	}
-	return count;
+
+	OOAdaptor *conn = [self prepareAggregate:OOFormat( @"%@, %@", *(groupBy/", "), *expressions )
+									metaData:metaData joinFrom:parent groupBy:groupBy];
+	if ( conn ) {
+		OO_RELEASE( *(out = [conn newResultSet]) );
+		[self checkinReader:conn];
+	}
+	return out;
 }
 
 /**
- Inserts a record into the database unless another record with the same key column values
- exists in which case it will do an update of the previous record (preserving the ROWID.)
+ Key of the values of the columns by which a record joins to another table.
+ nil if any of them are null as these do not take part in the join. Numbers
+ are keyed by their double value so 1 and 1.0 match as they do in sql.
  */
 
-- (int)upsert:(id)record {
-	OOArray<id> existing = [self select:nil intoClass:[record class] joinFrom:record];
-	if ( existing > 1 )
-		OOWarn( @"-[ODatabase upsert:] Duplicate record for upsert: %@", record );
-	if ( existing > 0 ) {
-		[self update:existing[0]];
-		(*transaction[-1])[kOOObject] = record;
-		return transaction;
+static NSString *ooJoinKey( OOMetaData *metaData, id record, cOOStringArray columns ) {
+	OOValueDictionary values = [metaData encode:[[record dictionaryWithValuesForKeys:columns] mutableCopy]];
+	NSMutableString *key = [NSMutableString string];
+	for ( NSString *name in *columns ) {
+		id value = values[name];
+		if ( value == OONull )
+			return nil;
+		if ( [value isKindOfClass:[NSNumber class]] )
+			[key appendFormat:@"%.17g\t", [value doubleValue]];
+		else
+			[key appendFormat:@"%@\t", [value stringValue]];
 	}
-	else
-		return [self insert:record];
+	return key;
 }
 
 /**
- Commit all pending inserts, updates and deletes to the database. Use commitTransaction to perform 
- this inside a database transaction.
+ Select the records related by natural join to each of an array of parents of the same
+ class in one "where (columns) in (...)" query, or as few as the parameter limit allows,
+ rather than a query per parent. The results are partitioned into an array for each
+ parent in the order of the parents. Parents with null join values are joined separately
+ as are all parents joining on more than one column before sqlite 3.15 (no row values.)
  */
 
-- (int)commit {
-	int commited = 0;
-
-	for ( int i=0 ; i<transaction ; i++ ) {
-		OOValueDictionary values = transaction[i];
-		OOString exec = (NSMutableString *)~values[kOOExecSQL];
-		if ( !!exec ) {
-			if ( ![self exec:@"%@", *exec] )
-				OOWarn( @"-[ODatabase commit] Error in transaction exec: %@ - %s", *exec, errmsg );
+- (OOArray<OOArray<id> >)select:(cOOString)select intoClass:(Class)recordClass joinFromArray:(const OOArray<id> &)parents {
+	OOArray<OOArray<id> > out;
+	if ( !parents )
+		return out;
+
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass],
+		*parentMetaData = [self tableMetaDataForClass:[parents[0] class]];
+	OOStringArray shared = [parentMetaData naturalJoinToTable:metaData];
+	int nparents = parents, ncols = shared;
+	BOOL rowValues = ncols == 1 || sqlite3_libversion_number() >= 3015000;
+	NSMutableArray *partitions = [NSMutableArray arrayWithCapacity:nparents];
+	OODictionary<NSMutableArray *> partitionsByKey;
+	OOArray<id> keyed;
+
+	for ( int p=0 ; p<nparents ; p++ ) {
+		NSMutableArray *partition = [NSMutableArray array];
+		[partitions addObject:partition];
+
+		NSString *key = ncols && rowValues ? ooJoinKey( parentMetaData, *parents[p], shared ) : nil;
+		if ( !key ) {
+			[partition addObjectsFromArray:*[self select:select intoClass:recordClass joinFrom:*parents[p]]];
 			continue;
 		}
 
-		OORef<NSObject *> object = *values[kOOObject]; values -= kOOObject;
-		BOOL isInsert = !!~values[kOOInsert], isUpdate = !!~values[kOOUpdate];
+		if ( !partitionsByKey[key] ) {
+			partitionsByKey[key] = [NSMutableArray array];
+			keyed += *parents[p];
+		}
+		[*partitionsByKey[key] addObject:partition];
+	}
 
-		OOMetaData *metaData = [self tableMetaDataForClass:[object class]];
-		OOValueDictionary newValues = [metaData encode:[[object dictionaryWithValuesForKeys:metaData->columns] mutableCopy]];
+	OOString sql = !select ?
+		OOFormat( @"select %@\nfrom %@", *(metaData->outcols/", "), *metaData->tableName ) : *select,
+		placeholders = "(?" + OOString( ", ?" ) * (ncols-1) + ")";
+	OOAdaptor *conn = [self checkoutReader];
+	int maxKeys = MAX( 1, [conn parameterLimit] / MAX( 1, ncols ) );
+
+	for ( int start=0 ; start<keyed ; start += maxKeys ) {
+		int nkeys = MIN( maxKeys, keyed-start );
+		OOString chunk = sql + OOFormat( ncols == 1 ? @"\nwhere %@ in (?" : @"\nwhere (%@) in (values %@",
+										*(shared/", "), *placeholders );
+		for ( int k=1 ; k<nkeys ; k++ )
+			chunk += ncols == 1 ? ", ?" : ", " + placeholders;
+		chunk += ")";
+
+		if ( [metaData->recordClass respondsToSelector:@selector(ooOrderBy)] )
+			chunk += OOFormat( @"\norder by %@", [metaData->recordClass ooOrderBy] );
+
+#ifdef OODEBUG_SQL
+		NSLog( @"-[OODatabase select:intoClass:joinFromArray:] %@ (%d keys)", *chunk, nkeys );
+#endif
+
+		if ( ![conn prepare:chunk] )
+			break;
+
+		for ( int k=0 ; k<nkeys ; k++ ) {
+			id parent = *keyed[start+k];
+			OOValueDictionary values = [parentMetaData encode:[[parent dictionaryWithValuesForKeys:shared] mutableCopy]];
+			[conn bindCols:shared values:values startingAt:1+k*ncols bindNulls:YES];
+		}
+
+		OOArray<id> records = [conn bindResultsIntoInstancesOfClass:recordClass metaData:metaData];
+		for ( id record in *records ) {
+			NSString *key = ooJoinKey( metaData, record, shared );
+			for ( NSMutableArray *partition in key ? *partitionsByKey[key] : nil )
+				[partition addObject:record];
+		}
+	}
+
+	[self checkinReader:conn];
+
+	for ( NSMutableArray *partition in partitions )
+		out += OOArray<id>( partition );
+	return out;
+}
+
+/**
+ Perform a select from a table on the database using either the sql specified 
+ orselect all columns from the table associated with the record class passed in.
+ If a parent is passed in make a natural join from that record.
+ */
+
+- (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass ? recordClass : [parent class]];
+	OOString sql = !select ?
+        OOFormat( @"select %@\nfrom %@", *(metaData->outcols/", "), *metaData->tableName ) : *select;
+
+	OOAdaptor *conn = [self checkoutReader];
+	OOArray<id> out;
+
+	if ( [self prepareSql:sql joinFrom:parent toTable:metaData adaptor:conn] )
+		out = [conn bindResultsIntoInstancesOfClass:recordClass metaData:metaData];
+	else
+		out = nil;
+
+	[self checkinReader:conn];
+	return out;
+}
+
+/**
+ As select:intoClass:joinFrom: but returns a cursor which steps through the results
+ as they are enumerated. The statement is owned by the cursor so other database
+ operations can be performed while it is open.
+ */
+
+- (OOCursor<id>)cursor:(cOOString)select intoClass:(Class)recordClass joinFrom:(id)parent {
+	OOMetaData *metaData = [self tableMetaDataForClass:recordClass ? recordClass : [parent class]];
+	OOString sql = !select ?
+        OOFormat( @"select %@\nfrom %@", *(metaData->outcols/", "), *metaData->tableName ) : *select;
+	OOAdaptor *conn = [self checkoutReader];
+	OOCursor<id> cursor;
+
+	// parameters must outlive the current statement
+	conn->transientBinds = YES;
+	BOOL onWriter = conn == *adaptor;
+	if ( [self prepareSql:sql joinFrom:parent toTable:metaData adaptor:conn] )
+		OO_RELEASE( *(cursor = [[OORecordCursor alloc] initAdaptor:conn ofDatabase:self onWriter:onWriter
+														 statement:[conn detachStatement] intoClass:recordClass metaData:metaData]) );
+	conn->transientBinds = NO;
+
+	// the cursor checks a reader back in once its statement is finished. A cursor on
+	// the writer takes the writer lock for each batch instead so it can be closed on
+	// any thread.
+	if ( !cursor || onWriter )
+		[self checkinReader:conn];
+	return cursor;
+}
+
+- (OOArray<id>)select:(cOOString)select intoClass:(Class)recordClass {
+	return [self select:select intoClass:recordClass joinFrom:nil];
+}
+
+- (OOArray<id>)select:(cOOString)select {
+	return [self select:select intoClass:nil joinFrom:nil];
+}
+
+/**
+ Returns sqlite3 row identifier for a record instance.
+ */
+
+- (long long)rowIDForRecord:(id)record {
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	OOString sql = OOFormat( @"select ROWID from %@", *metaData->tableName );
+	OOArray<OODictionary<NSNumber *> > idResults = [self select:sql intoClass:nil joinFrom:record];
+	return idResults > 0 ? [*(*idResults[0])[@"rowid"] longLongValue] : 0;
+}
+
+/**
+ Returns sqlite3 row identifier for last inserted record.
+ */
+
+- (long long)lastInsertRowID {
+	return [*adaptor lastInsertRowID];
+}
+
+/**
+ Returns the rowid of the row with the same ooTableKey values as a record or 0 if there is none.
+ */
+
+- (long long)rowIDForKeyOf:(id)record metaData:(OOMetaData *)metaData {
+	OOValueDictionary keyValues = [metaData encode:OO_AUTORELEASE( [[record dictionaryWithValuesForKeys:metaData->keys] mutableCopy] )];
+	OOString sql = OOFormat( @"select rowid from %@", *metaData->tableName );
+	sql += [self whereClauseFor:metaData->keys values:keyValues qualifyNulls:YES];
+
+	OOAdaptor *conn = [self checkoutReader];
+	sqlite3_int64 rowid = 0;
+	if ( [conn prepare:sql] && [conn bindCols:metaData->keys values:keyValues startingAt:1 bindNulls:NO] )
+		[conn stepAggregate:&rowid real:NULL];
+	[self checkinReader:conn];
+	return rowid;
+}
+
+// the row of a record found by its rowid ivar, its key or for tables without a key by natural join
+static long long ooStoredRowID( OODatabase *db, OOMetaData *metaData, id record ) {
+	if ( !!metaData->rowidColumn )
+		return [[record valueForKey:*metaData->rowidColumn] longLongValue];
+	return !!metaData->keys ? [db rowIDForKeyOf:record metaData:metaData] : [db rowIDForRecord:record];
+}
+
+/**
+ Load the value of one of the ooDeferredColumns of a record, which are left out of selects,
+ into its ivar using sqlite3_blob_read. This is called by the getter generated for the
+ column the first time it is used.
+ */
+
+- (id)deferredColumn:(cOOString)column ofRecord:(id)record {
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	int p = 0;
+	while ( p<metaData->nplan && strcmp( metaData->plan[p].name, column ) != 0 )
+		p++;
+	if ( p == metaData->nplan ) {
+		OOWarn( @"-[OODatabase deferredColumn:ofRecord:] Class %@ has no column %@", *metaData->recordClassName, *column );
+		return nil;
+	}
+
+	const struct _ooIvarPlan &plan = metaData->plan[p];
+	long long rowid = ooStoredRowID( self, metaData, record );
+	OOAdaptor *conn = [self checkoutReader];
+	sqlite3_blob *blob = [conn openBlob:column table:metaData->tableName row:rowid writable:NO];
+	id value = nil;
+
+	// a null value can't be opened and is left as nil. Any other failure leaves the column
+	// unloaded so it is tried again next time.
+	if ( !blob ) {
+		OOValueDictionary rowValues;
+		rowValues[@"rowid"] = [NSNumber numberWithLongLong:rowid];
+		sqlite3_int64 isNull = 0;
+		if ( !rowid || ![conn prepare:OOFormat( @"select %@ is null from %@ where rowid = ?", *column, *metaData->tableName )] ||
+			![conn bindCols:OOStringArray( @"rowid", nil ) values:rowValues startingAt:1 bindNulls:NO] ||
+			![conn stepAggregate:&isNull real:NULL] || !isNull ) {
+			OOWarn( @"-[OODatabase deferredColumn:ofRecord:] Could not load %@ of row %lld of %@",
+				   *column, rowid, *metaData->tableName );
+			[self checkinReader:conn];
+			return nil;
+		}
+	}
+	else {
+		NSMutableData *data = [NSMutableData dataWithLength:sqlite3_blob_bytes( blob )];
+		int errcode = sqlite3_blob_read( blob, [data mutableBytes], (int)[data length], 0 );
+		if ( errcode != SQLITE_OK ) {
+			OOWarn( @"-[OODatabase deferredColumn:ofRecord:] Error reading %@ - %s", *column, sqlite3_errstr( errcode ) );
+			sqlite3_blob_close( blob );
+			[self checkinReader:conn];
+			return nil;
+		}
+
+		if ( plan.text )
+			value = OO_AUTORELEASE( [[NSMutableString alloc] initWithData:data encoding:NSUTF8StringEncoding] );
+		else if ( plan.archived )
+			value = [plan.codec decodeColumnData:data];
+		else
+			value = data;
+		sqlite3_blob_close( blob );
+	}
+
+	[self checkinReader:conn];
+
+	ooSetObjectIvar( record, plan.offset, value );
+	[(NSMutableIndexSet *)objc_getAssociatedObject( record, &kOOUnloadedKey ) removeIndex:p];
+	return value;
+}
+
+/**
+ Open the value of a column of the row of a record to be read or written incrementally.
+ The row is found using the record's rowid column or its key values.
+ */
+
+- (OOReference<OOBlob *>)openBlob:(cOOString)column ofRecord:(id)record writable:(BOOL)writable {
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	long long rowid = ooStoredRowID( self, metaData, record );
+	OOReference<OOBlob *> out;
+
+	if ( writable ) {
+		OOWriterLock writer( self );
+		sqlite3_blob *blob = [*adaptor openBlob:column table:metaData->tableName row:rowid writable:YES];
+		if ( blob )
+			OO_RELEASE( *(out = [[OOBlob alloc] initAdaptor:*adaptor blob:blob]) );
+	}
+	else {
+		OOAdaptor *conn = [self checkoutReader];
+		sqlite3_blob *blob = [conn openBlob:column table:metaData->tableName row:rowid writable:NO];
+		if ( blob )
+			OO_RELEASE( *(out = [[OOBlob alloc] initAdaptor:conn blob:blob]) );
+		[self checkinReader:conn];
+	}
+
+	if ( !out )
+		OOWarn( @"-[OODatabase openBlob:ofRecord:writable:] Could not open %@ of row %lld of %@",
+			   *column, rowid, *metaData->tableName );
+	return out;
+}
+
+/**
+ Set the value of a column of the row of a record to "length" zero bytes so it can then be
+ written incrementally using an OOBlob. This takes effect immediately rather than on commit.
+ */
+
+- (BOOL)reserveBlob:(cOOString)column ofRecord:(id)record length:(int)length {
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	long long rowid = ooStoredRowID( self, metaData, record );
+	return [self exec:@"update %@ set %@ = zeroblob(%d) where rowid = %lld",
+			*metaData->tableName, *column, length, rowid];
+}
+
+/**
+ Hit, miss and eviction counts for the prepared statement cache.
+ */
+
+- (OODictionary<NSNumber *>)statementCacheStatistics {
+	OOAdaptor *conn = *adaptor;
+	OODictionary<NSNumber *> stats;
+	stats[@"hits"] = OOInt( conn->cacheHits );
+	stats[@"misses"] = OOInt( conn->cacheMisses );
+	stats[@"evictions"] = OOInt( conn->cacheEvictions );
+	return stats;
+}
+
+/**
+ Statistics collected since profiling was enabled or reset for each statement. Times are
+ in milliseconds and "p99" is over the last OOSQL_PROFILE_SAMPLES executions.
+ */
+
+- (OODictionary<NSDictionary *>)profileStatistics {
+	return [*profile statistics];
+}
+
+- (OOString)profileJSON {
+	OODictionary<NSDictionary *> statistics = [self profileStatistics];
+	NSData *json = [NSJSONSerialization dataWithJSONObject:!!statistics ? *statistics : [NSDictionary dictionary]
+												   options:NSJSONWritingPrettyPrinted error:NULL];
+	return OO_AUTORELEASE( [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding] );
+}
+
+- (void)resetProfile {
+	[*profile reset];
+}
+
+/**
+ Rows imported and lines that failed to import by the last call to importFile:intoClass:delimiter:
+ with the time it took in seconds and the resulting rate.
+ */
+
+- (OODictionary<NSNumber *>)importStatistics {
+	OODictionary<NSNumber *> stats;
+	stats[@"rows"] = [NSNumber numberWithInt:importedRows];
+	stats[@"failed"] = [NSNumber numberWithInt:importFailures];
+	stats[@"seconds"] = [NSNumber numberWithDouble:importSeconds];
+	stats[@"rowsPerSecond"] = [NSNumber numberWithDouble:importSeconds > 0 ? importedRows / importSeconds : 0.];
+	return stats;
+}
+
+/**
+ Counts of text parameters bound without copying, copied into the bind arena and of the
+ arena blocks allocated to hold them.
+ */
+
+- (OODictionary<NSNumber *>)bindStatistics {
+	OOAdaptor *conn = *adaptor;
+	OODictionary<NSNumber *> stats;
+	stats[@"nocopy"] = [NSNumber numberWithLong:conn->bindNoCopy];
+	stats[@"copied"] = [NSNumber numberWithLong:conn->bindArenaCopies];
+	stats[@"mallocs"] = [NSNumber numberWithLong:conn->arenaMallocs];
+	return stats;
+}
+
+/**
+ Insert an array of record objects into the database. This needs to be commited to take effect.
+ */
+
+- (int)insertArray:(const OOArray<id> &)objects {
+	int count = 0;
+	for ( id object in *objects )
+		count = [self insert:object];
+	return count;
+}
+
+/**
+ Delete an array of record objects from the database. This needs to be commited to take effect.
+ */
+
+- (int)deleteArray:(const OOArray<id> &)objects {
+	int count = 0;
+	for ( id object in *objects )
+		if ( ![object respondsToSelector:@selector(delete)] )
+			count = [self delete:object];
+		else {
+			[object delete];
+			count++;
+		}
+	return count;
+}
+
+/**
+ Insert the values of the record class instance at the time this method was called into the db.
+ (must be commited to take effect). Returns the total number of outstanding inserts/updates/deletes.
+ */
+
+- (int)insert:(id)record {
+	OOWriterLock writer( self );
+	return transaction += OOValueDictionary( kOOObject, record, kOOInsert, kOOInsert, nil );
+}
+
+/**
+ Use the values of the record instance at the time this method is called in a where clause to 
+ delete from the database when commit is called. Returns the total number of outstanding
+ inserts/updates/deletes.
+ */
+
+- (int)delete:(id)record {
+	OOWriterLock writer( self );
+	return transaction += OOValueDictionary( kOOObject, record, nil );
+}
+
+/**
+ The values of all the columns of a record to compare against when an update is committed.
+ */
+
+- (OOValueDictionary)snapshotOf:(id)record metaData:(OOMetaData *)metaData {
+	OOValueDictionary oldValues = [metaData encodeRecord:record];
+	for ( NSString *key in *metaData->tocopy )
+		if ( ~oldValues[key] )
+			OO_RELEASE( oldValues[key] = [oldValues[key] copy] );
+	oldValues[kOOUpdate] = (id)kOOUpdate;
+	oldValues[kOOObject] = record;
+	return oldValues;
+}
+
+/**
+ Call this method if you intend to make changes to the record object and save them to the database.
+ This takes a snapshot of the previous values to use as a key for the update operation when "commit"
+ is called. Returns the total number of outstanding inserts/updates/deletes.
+ */
+
+- (int)update:(id)record {
+	OOWriterLock writer( self );
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	OOValueDictionary oldValues;
+
+	// records that track their changes encode only the values identifying their row and
+	// those of columns without a tracking setter. The other ivars are copied as they are.
+	if ( metaData->tracksChanges ) {
+		OOStringArray snapshotCols;
+		if ( !!metaData->untracked )
+			snapshotCols += *metaData->untracked;
+		for ( NSString *key in *metaData->keys )
+			if ( ![*snapshotCols containsObject:key] )
+				snapshotCols += key;
+		if ( !!metaData->rowidColumn && ![*snapshotCols containsObject:*metaData->rowidColumn] )
+			snapshotCols += *metaData->rowidColumn;
+		oldValues = [metaData encodeColumns:snapshotCols ofRecord:record];
+		if ( [self keyColumnsFor:metaData values:oldValues] != metaData->columns ) {
+			NSMutableIndexSet *changes = objc_getAssociatedObject( record, &kOOChangesKey );
+			if ( !changes )
+				objc_setAssociatedObject( record, &kOOChangesKey, changes = [NSMutableIndexSet indexSet],
+										 OBJC_ASSOCIATION_RETAIN_NONATOMIC );
+			NSMutableArray *held = [NSMutableArray array];
+			oldValues[kOOIvars] = [metaData ivarsOf:record holding:held];
+			oldValues[kOOHeld] = held;
+			oldValues[kOOChanges] = changes;
+		}
+		else
+			oldValues = nil;
+	}
+
+	if ( !oldValues )
+		return transaction += [self snapshotOf:record metaData:metaData];
+
+	for ( NSString *key in *metaData->tocopy )
+		if ( ~oldValues[key] )
+			OO_RELEASE( oldValues[key] = [oldValues[key] copy] );
+	oldValues[kOOUpdate] = (id)kOOUpdate;
+	oldValues[kOOObject] = record;
+	return transaction += oldValues;
+}
+
+/**
+ Can an upsert or indate of a record be sent to the database as a single "insert or replace"
+ or "insert ... on conflict" statement? This needs the table to have ooTableKey columns, all
+ of which have values, and for upsert a version of sqlite that supports "on conflict".
+ The existing row is then the one whose key columns conflict with the record rather than
+ those equal to it on all of its non-null columns by natural join.
+ */
+
+- (BOOL)canUpsert:(id)record metaData:(OOMetaData *)metaData native:(BOOL)native {
+	if ( !metaData->keys || (native && sqlite3_libversion_number() < 3024000) )
+		return NO;
+
+	OOValueDictionary values = [metaData encode:[[record dictionaryWithValuesForKeys:metaData->keys] mutableCopy]];
+	for ( NSString *key in *metaData->keys )
+		if ( *values[key] == OONull )
+			return NO;
+
+	return YES;
+}
+
+/**
+ Select the row of a table with the same ooTableKey values as a record on the writer.
+ Used by rollback to restore records queued by a native upsert or indate to the values
+ of the row they would have replaced, which is unchanged until the commit.
+ */
+
+- (OOArray<id>)selectKeyOf:(id)record metaData:(OOMetaData *)metaData {
+	OOValueDictionary keyValues = [metaData encode:OO_AUTORELEASE( [[record dictionaryWithValuesForKeys:metaData->keys] mutableCopy] )];
+	OOString sql = OOFormat( @"select %@\nfrom %@", *(metaData->outcols/", "), *metaData->tableName );
+	sql += [self whereClauseFor:metaData->keys values:keyValues qualifyNulls:YES];
+
+	OOArray<id> existing;
+	if ( [*adaptor prepare:sql] && [*adaptor bindCols:metaData->keys values:keyValues startingAt:1 bindNulls:NO] )
+		existing = [*adaptor bindResultsIntoInstancesOfClass:[record class] metaData:metaData];
+	return existing;
+}
+
+/**
+ Inserts a record into the database the deletes any previous record with the same key.
+ This ensures the record's rowid changes if this is used by child records. For tables
+ with ooTableKey columns the previous record is the one with the same key values.
+ */
+
+- (int)indate:(id)record {
+	OOWriterLock writer( self );
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	if ( [self canUpsert:record metaData:metaData native:NO] ) {
+		// the row replaced needs to go through the delete trigger of a full text index
+		if ( !!metaData->fullTextTable ) {
+			[self delete:record];
+			return [self insert:record];
+		}
+		return transaction += OOValueDictionary( kOOObject, record, kOOInsert, kOOReplace, nil );
+	}
+
+	OOString sql = OOFormat( @"select rowid from %@", *metaData->tableName );
+	OOArray<id> existing = [self select:sql intoClass:nil joinFrom:record];
+	int count = [self insert:record];
+	for ( NSDictionary *exist in *existing ) {
+		OOString sql = OOFormat( @"delete from %@ where rowid = %ld", *metaData->tableName, 
+								(long)[[exist objectForKey:@"rowid"] longLongValue] );
+		transaction += OOValueDictionary( kOOExecSQL, *sql, nil );
+	}
+	return count;
+}
+
+/**
+ Inserts a record into the database unless another record with the same key column values
+ exists in which case it will do an update of the previous record (preserving the ROWID.)
+ For tables with ooTableKey columns the previous record is the one with the same key values,
+ otherwise it is the one equal to the record on all of its non-null columns.
+ */
+
+- (int)upsert:(id)record {
+	OOWriterLock writer( self );
+	OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+	if ( [self canUpsert:record metaData:metaData native:YES] )
+		return transaction += OOValueDictionary( kOOObject, record, kOOInsert, kOOUpsert, nil );
+
+	OOArray<id> existing = [self select:nil intoClass:[record class] joinFrom:record];
+	if ( existing > 1 )
+		OOWarn( @"-[ODatabase upsert:] Duplicate record for upsert: %@", record );
+	if ( existing > 0 ) {
+		// the record just selected has no changes recorded so all columns are compared
+		OOValueDictionary oldValues = [self snapshotOf:existing[0] metaData:metaData];
+		oldValues[kOOObject] = record;
+		return transaction += oldValues;
+	}
+	else
+		return [self insert:record];
+}
+
+/**
+ Insert a run of records for the same table using multi-row "insert ... values (...),(...)"
+ statements sized to the number of parameters sqlite allows. Values are bound directly
+ from the records' ivars. Should a chunk fail (for example on a key constraint) its rows
+ are retried individually so the other rows are still inserted as they would have been
+ when committing row by row. Upserts and indates of tables with keys are sent the same way
+ as "insert ... on conflict (keys) do update" and "insert or replace" respectively.
+ */
+
+- (int)insertRows:(const OOArray<id> &)rows metaData:(OOMetaData *)metaData mode:(NSString *)mode {
+	int ncols = MAX( 1, (int)metaData->columns ), inserted = 0,
+		maxRows = MAX( 1, MIN( OOSQL_MAX_INSERT_ROWS, [*adaptor parameterLimit] / ncols ) );
+	OOString insert = OOFormat( @"insert%@ into %@ (%@) values ", mode == kOOReplace ? @" or replace" : @"",
+							   *metaData->tableName, *(metaData->columns/", ") ),
+		placeholders = "(?" + OOString( ", ?" ) * (ncols-1) + ")", conflict;
+
+	if ( mode == kOOUpsert ) {
+		OOStringArray assignments;
+		for ( NSString *name in *metaData->columns )
+			if ( ![*metaData->keys containsObject:name] )
+				assignments += OOFormat( @"%@ = excluded.%@", name, name );
+
+		conflict = OOFormat( @"\non conflict (%@) do %@", *(metaData->keys/", "),
+							!assignments ? @"nothing" : *("update set " + assignments/", ") );
+	}
+
+	for ( int start=0 ; start<rows ; start += maxRows ) {
+		int nrows = MIN( maxRows, rows-start );
+		OOString sql = insert + placeholders;
+		for ( int r=1 ; r<nrows ; r++ )
+			sql += ",\n\t" + placeholders;
+		sql += conflict;
+
+#ifdef OODEBUG_SQL
+		NSLog( @"-[OODatabase insertRows:metaData:]: %@ (%d rows)", *insert, nrows );
+#endif
+
+		if ( [*adaptor prepare:sql] ) {
+			for ( int r=0 ; r<nrows ; r++ )
+				[*adaptor bindRecord:rows[start+r] metaData:metaData startingAt:1+r*ncols];
+			[*adaptor bindResultsIntoInstancesOfClass:nil metaData:metaData];
+		}
+
+		if ( errcode == SQLITE_OK )
+			inserted += updateCount;
+		else if ( nrows > 1 )
+			for ( int r=0 ; r<nrows ; r++ )
+				inserted += [self insertRows:OOArray<id>( *rows[start+r], nil ) metaData:metaData mode:mode];
+	}
+
+	return inserted;
+}
+
+// remember the first error of a commit as the statements after it set errcode again
+static void ooNoteError( OODatabase *db, int &failed, OOString &failedMsg ) {
+	if ( db->errcode != SQLITE_OK && failed == SQLITE_OK ) {
+		failed = db->errcode;
+		failedMsg = db->errmsg ? db->errmsg : "";
+	}
+}
+
+/**
+ Commit all pending inserts, updates and deletes to the database. Use commitTransaction to perform 
+ this inside a database transaction. Otherwise, when there is more than one pending operation
+ they are applied inside a single implicit transaction. Consecutive inserts into a table are
+ sent as multi-row inserts. Updates and deletes are not merged into multi-row statements;
+ instead those of the same class, operation and changed columns generate the same SQL and
+ so reuse the one cached prepared statement, only binding new values for each record.
+ */
+
+- (int)commit {
+	OOWriterLock writer( self );
+	int commited = 0;
+	BOOL implicit = transaction > 1 && ![*adaptor inTransaction];
+	OOArray<id> inserts;
+	OOMetaData *insertMetaData = nil;
+	NSString *insertMode = nil;
+	BOOL changesRows = NO;
+	int failed = SQLITE_OK;
+	OOString failedMsg;
+
+	if ( implicit )
+		[self exec:@"BEGIN TRANSACTION"];
+
+	for ( int i=0 ; i<transaction ; i++ ) {
+		OOValueDictionary values = transaction[i];
+		OOString exec = (NSMutableString *)~values[kOOExecSQL];
+		OORef<NSObject *> object = *values[kOOObject];
+		NSString *mode = ~values[kOOInsert];
+		BOOL isInsert = !!mode, isUpdate = !!~values[kOOUpdate];
+		changesRows |= mode != kOOInsert;
+		OOMetaData *metaData = !exec ? [self tableMetaDataForClass:[*object class]] : nil;
+
+		if ( !!inserts && (!isInsert || metaData != insertMetaData || mode != insertMode) ) {
+			commited += [self insertRows:inserts metaData:insertMetaData mode:insertMode];
+			ooNoteError( self, failed, failedMsg );
+			inserts = nil;
+		}
+
+		if ( !!exec ) {
+			if ( ![self exec:@"%@", *exec] )
+				OOWarn( @"-[ODatabase commit] Error in transaction exec: %@ - %s", *exec, errmsg );
+			ooNoteError( self, failed, failedMsg );
+			continue;
+		}
+
+		values -= kOOObject;
+
+		if ( isInsert ) {
+			insertMetaData = metaData;
+			insertMode = mode;
+			inserts += *object;
+			continue;
+		}
+
+		NSIndexSet *changes = ~values[kOOChanges];
+		OOValueDictionary newValues = !changes ? [metaData encodeRecord:*object] : nil;
 		OOStringArray changedCols;
 
-		if ( isUpdate ) {
-			for ( NSString *name in *metaData->columns )
-				if ( ![*newValues[name] isEqual:values[name]] )
-					changedCols += name;
+		if ( changes ) {
+			NSMutableIndexSet *changed = OO_AUTORELEASE( [changes mutableCopy] );
+			[metaData addIvarsOf:*object changedSince:~values[kOOIvars] to:changed];
+			for ( NSUInteger p=[changed firstIndex] ; p != NSNotFound ; p=[changed indexGreaterThanIndex:p] ) {
+				NSString *name = [NSString stringWithUTF8String:metaData->plan[p].name];
+				newValues[name] = [metaData valueForPlan:(int)p ofRecord:*object];
+				changedCols += name;
+			}
+
+			// columns without a tracking setter are still compared with their snapshot
+			OOValueDictionary untracked = [metaData encodeColumns:metaData->untracked ofRecord:*object];
+			for ( NSString *name in *metaData->untracked )
+				if ( ![*changedCols containsObject:name] && ![*untracked[name] isEqual:values[name]] ) {
+					newValues[name] = *untracked[name];
+					changedCols += name;
+				}
+
+			objc_setAssociatedObject( *object, &kOOChangesKey, nil, OBJC_ASSOCIATION_RETAIN_NONATOMIC );
+			values -= kOOChanges;
+			values -= kOOIvars;
+			values -= kOOHeld;
+		}
+		else if ( isUpdate ) {
+			for ( NSString *name in *metaData->columns )
+				if ( ![*newValues[name] isEqual:values[name]] )
+					changedCols += name;
+		}
+		else 
+			values = newValues;
+
+		OOString sql = OOFormat( isUpdate ? @"update %@ set" : @"delete from %@", *metaData->tableName );
+
+		int nchanged = changedCols;
+		if ( isUpdate && nchanged == 0 ) {
+			OOWarn( @"%s %@ (%@)", errmsg = (char *)"-[ODatabase commit:] Update of unchanged record", *object, *(lastSQL = sql) );
+			continue;
+		}
+
+		for ( int i=0 ; i<nchanged ; i++ )
+			sql += OOFormat( @"%s\n\t%@ = ?", i==0 ? "" : ",", **changedCols[i] );
+
+		OOStringArray keyCols = [self keyColumnsFor:metaData values:values];
+		sql += [self whereClauseFor:keyCols values:values qualifyNulls:YES];
+
+#ifdef OODEBUG_SQL
+		NSLog( @"-[OODatabase commit]: %@ %@", *sql, *values );
+#endif
+
+		if ( ![*adaptor prepare:sql] ) {
+			ooNoteError( self, failed, failedMsg );
+			continue;
+		}
+
+		if ( isUpdate )
+			[*adaptor bindCols:changedCols values:newValues startingAt:1 bindNulls:YES];
+		[*adaptor bindCols:keyCols values:values startingAt:1+nchanged bindNulls:NO];
+
+		[*adaptor bindResultsIntoInstancesOfClass:nil metaData:metaData];
+		ooNoteError( self, failed, failedMsg );
+		commited += updateCount;
+	}
+
+	if ( !!inserts ) {
+		commited += [self insertRows:inserts metaData:insertMetaData mode:insertMode];
+		ooNoteError( self, failed, failedMsg );
+	}
+
+	if ( implicit && ![self exec:@"COMMIT"] )
+		OOWarn( @"-[ODatabase commit] Error committing implicit transaction - %s", errmsg );
+
+	// errcode is left as the first error of the commit rather than that of its last statement
+	if ( errcode == SQLITE_OK && failed != SQLITE_OK ) {
+		errcode = failed;
+		errmsg = (char *)[*failedMsg UTF8String];
+	}
+
+	if ( changesRows )
+		[self invalidateIdentityMap];
+
+	transaction = nil;
+	return commited;
+}
+
+/**
+ Commit all pending inserts, updates, deletes to the database inside a transaction.
+ */
+
+- (int)commitTransaction {
+	OOWriterLock writer( self );
+	[self exec:@"BEGIN TRANSACTION"];
+	int updated = [self commit];
+	return [self exec:@"COMMIT"] ? updated : 0;
+}
+
+/**
+ Commit the pending inserts, updates and deletes on the writer queue without waiting.
+ The first request of a group schedules the group to be committed after groupCommitWindow
+ seconds; later requests join it until then.
+ */
+
+- (void)commitAsync:(OOCommitCompletion)completion {
+	OOWriterLock writer( self );
+	OOCommitRequest *request = [[OOCommitRequest alloc] initTransaction:transaction completion:completion];
+	transaction = nil;
+	pendingCommits += request;
+	OO_RELEASE( request );
+
+	if ( (int)pendingCommits == 1 ) {
+		if ( !writerQueue )
+			writerQueue = dispatch_queue_create( "objsql.writer", DISPATCH_QUEUE_SERIAL );
+		dispatch_after( dispatch_time( DISPATCH_TIME_NOW, (int64_t)(groupCommitWindow * NSEC_PER_SEC) ),
+					   writerQueue, ^{ [self flushCommits]; } );
+	}
+}
+
+/**
+ Apply a group of commit requests inside one transaction then call their completions.
+ */
+
+- (void)flushCommits {
+	OOArray<OOCommitRequest *> requests;
+
+	{
+		OOWriterLock writer( self );
+		requests = pendingCommits;
+		pendingCommits = nil;
+		if ( !requests )
+			return;
+
+		OOArray<OOValueDictionary > pending = transaction;
+		BOOL group = ![*adaptor inTransaction];
+
+		if ( group )
+			[self exec:@"BEGIN TRANSACTION"];
+
+		for ( OOCommitRequest *request in *requests ) {
+			transaction = request->transaction;
+			request->updated = [self commit];
+			if ( (request->errcode = errcode) != SQLITE_OK && errmsg )
+				request->errmsg = errmsg;
+		}
+
+		transaction = pending;
+
+		if ( group && ![self exec:@"COMMIT"] ) {
+			OOWarn( @"-[ODatabase flushCommits] Error committing group of %d - %s", (int)requests, errmsg );
+			for ( OOCommitRequest *request in *requests ) {
+				request->updated = 0;
+				request->errcode = errcode;
+				if ( errmsg )
+					request->errmsg = errmsg;
+			}
+			[self exec:@"ROLLBACK"];
+		}
+	}
+
+	for ( OOCommitRequest *request in *requests )
+		if ( request->completion )
+			request->completion( request->updated, request->errcode, *request->errmsg );
+}
+
+/**
+ Commit any requests waiting for their group commit window without waiting for it
+ to elapse. Must not be called from a completion block as that runs on the writer queue.
+ A thread holding the writer lock or with a transaction open commits them itself as the
+ writer queue would wait for the lock or commit into the thread's transaction.
+ */
+
+- (void)waitForCommits {
+	NSThread *thread = [NSThread currentThread];
+	if ( writerThread == thread || transactionThread == thread )
+		[self flushCommits];
+	else if ( writerQueue )
+		dispatch_sync( writerQueue, ^{ [self flushCommits]; } );
+}
+
+/**
+ Rollback any outstanding inserts, updates, or deletes. Please note updated values 
+ are also rolled back inside the actual record in the application as well. Records
+ upserted or indated by key are restored from the row they would have replaced.
+ */
+
+- (int)rollback {
+	OOWriterLock writer( self );
+	// rows selected to restore records must not be the mapped records themselves
+	[self invalidateIdentityMap];
+
+	for ( NSMutableDictionary *d in *transaction ) {
+		OODictionary<id> values = d;
+
+		// native upserts and indates take their snapshot now from the row they would replace
+		NSString *mode = ~values[kOOInsert];
+		if ( mode == kOOUpsert || mode == kOOReplace ) {
+			id record = ~values[kOOObject];
+			OOMetaData *metaData = [self tableMetaDataForClass:[record class]];
+			OOArray<id> existing = [self selectKeyOf:record metaData:metaData];
+			if ( existing > 0 ) {
+				OOValueDictionary snapshot = [self snapshotOf:existing[0] metaData:metaData];
+				snapshot[kOOObject] = record;
+				values = *snapshot;
+			}
+		}
+
+		if ( !!~values[kOOUpdate] ) {
+			OORef<OORecord *> record = ~values[kOOObject];
+			OOMetaData *metaData = [self tableMetaDataForClass:[*record class]];
+
+#ifndef OO_ARC
+			for ( NSString *name in *metaData->boxed )
+                OO_RELEASE( (id)[[*record valueForKey:name] pointerValue] );
+#endif
+
+			// records tracking changes are restored from the copy of their ivars
+			if ( ~values[kOOIvars] )
+				[metaData restoreIvarsOf:*record from:~values[kOOIvars]];
+			values -= kOOChanges;
+			values -= kOOIvars;
+			values -= kOOHeld;
+			[*record setValuesForKeysWithDictionary:[metaData decode:values]];
+			objc_setAssociatedObject( *record, &kOOChangesKey, nil, OBJC_ASSOCIATION_RETAIN_NONATOMIC );
+		}
+	}
+	[self invalidateIdentityMap];
+	return (int)[*~transaction count];
+}
+
+/**
+ Find/create an instance of the OOMetaData class which describes a record class and its associated table.
+ If the table does not exist it will be created along with indexes for columns/ivars which have 
+ upper case names for use in joins. Details of the tables parameters can be controlled by using
+ methods in the OOTableCustomisation protool. If it does not exist a meta table class which
+ prepresents OOMetaData records themselves is also created from which the list of all registered
+ tables can be selected.
+ */
+ 
+- (OOMetaData *)tableMetaDataForClass:(Class)recordClass {
+	if ( !recordClass || recordClass == [OOMetaData class] )
+		return [OOMetaData metaDataForClass:[OOMetaData class]];
+
+	OOString className = class_getName( recordClass );
+	OOMetaData *metaData;
+
+	// once a class's table is set up it is found without waiting for the writer
+	@synchronized( *metaDataLock ) {
+		metaData = tableMetaDataByClassName[className];
+	}
+	if ( metaData )
+		return metaData;
+
+	OOWriterLock writer( self );
+	@synchronized( *metaDataLock ) {
+		metaData = tableMetaDataByClassName[className];
+	}
+
+	if ( !metaData ) {
+		metaData = [OOMetaData metaDataForClass:recordClass];
+
+#ifdef OODEBUG_SQL
+		NSLog(@"\n%@", *metaData->createTableSQL);
+#endif
+
+		if ( metaData->tableName[0] != '_' && ![self schemaContains:metaData->tableName] ) {
+			OOReference<NSMutableSet *> names = schemaNames;
+			if ( [self exec:@"%@", *metaData->createTableSQL] )
+				for ( NSString *idx in *metaData->indexes )
+					if ( ![self exec:idx] )
+						OOWarn( @"-[OOMetaData tableMetaDataForClass:] Error creating index: %@", idx );
+			// the table created is known so there is no need to read the schema again
+			[*names addObject:[*metaData->tableName lowercaseString]];
+			schemaNames = names;
+
+			// an index left from a table that has been dropped has no triggers
+			if ( !!metaData->fullTextSQL )
+				[self exec:@"drop table if exists %@", *metaData->fullTextTable];
+		}
+		else if ( metaData->tableName[0] != '_' && !!metaData->archived )
+			[metaData useCodecsRecordedIn:[self stringForSql:@"select sql from sqlite_master where type = 'table' and name = '%@'",
+										   *metaData->tableName]];
+
+		if ( metaData->tableName[0] != '_' && !!metaData->fullTextSQL ) {
+			if ( ![self schemaContains:metaData->fullTextTable] ) {
+				OOReference<NSMutableSet *> names = schemaNames;
+				for ( NSString *sql in *metaData->fullTextSQL )
+					if ( ![self exec:@"%@", sql] )
+						OOWarn( @"-[OOMetaData tableMetaDataForClass:] Error creating full text index: %@", sql );
+				[self exec:@"insert into %@ (%@) values ('rebuild')", *metaData->fullTextTable, *metaData->fullTextTable];
+				[*names addObject:[*metaData->fullTextTable lowercaseString]];
+				schemaNames = names;
+			}
+		}
+
+		@synchronized( *metaDataLock ) {
+			tableMetaDataByClassName[className] = metaData;
+		}
+	}
+
+	return metaData;
+}
+
+@end
+
+#pragma mark OOCommitRequest - a commit waiting on the writer queue
+
+@implementation OOCommitRequest
+
+- initTransaction:(const OOArray<OOValueDictionary > &)aTransaction completion:(OOCommitCompletion)aCompletion {
+	if ( (self = [super init]) ) {
+		transaction = aTransaction;
+		completion = [aCompletion copy];
+	}
+	return self;
+}
+
+- (void)dealloc {
+	OO_RELEASE( completion );
+	OO_DEALLOC( super );
+}
+
+@end
+
+#pragma mark OOSqlProfile - statistics on statements executed
+
+struct _ooTimings {
+	long count;
+	sqlite3_int64 total, min, max, samples[OOSQL_PROFILE_SAMPLES];
+};
+
+static void ooAddTiming( struct _ooTimings &timings, sqlite3_int64 ns ) {
+	timings.samples[timings.count % OOSQL_PROFILE_SAMPLES] = ns;
+	timings.min = timings.count ? MIN( timings.min, ns ) : ns;
+	timings.max = MAX( timings.max, ns );
+	timings.total += ns;
+	timings.count++;
+}
+
+static int ooCompareTimings( const void *a, const void *b ) {
+	sqlite3_int64 diff = *(const sqlite3_int64 *)a - *(const sqlite3_int64 *)b;
+	return diff < 0 ? -1 : diff > 0;
+}
+
+static NSDictionary *ooTimingsDictionary( const struct _ooTimings &timings ) {
+	long n = MIN( timings.count, OOSQL_PROFILE_SAMPLES );
+	sqlite3_int64 sorted[OOSQL_PROFILE_SAMPLES];
+	memcpy( sorted, timings.samples, n * sizeof *sorted );
+	qsort( sorted, n, sizeof *sorted, ooCompareTimings );
+
+	return [NSDictionary dictionaryWithObjectsAndKeys:
+			[NSNumber numberWithLong:timings.count], @"count",
+			[NSNumber numberWithDouble:timings.total / 1e6], @"total",
+			[NSNumber numberWithDouble:timings.min / 1e6], @"min",
+			[NSNumber numberWithDouble:timings.max / 1e6], @"max",
+			[NSNumber numberWithDouble:n ? sorted[(n * 99 + 99) / 100 - 1] / 1e6 : 0.], @"p99", nil];
+}
+
+/**
+ Normalize sql for grouping statistics: runs of white space become a single space and
+ string and numeric literals are replaced by "?".
+ */
+
+static NSString *ooNormalizeSql( const char *sql ) {
+	size_t len = strlen( sql );
+	char *out = (char *)malloc( len + 1 ), *optr = out;
+
+	for ( const char *ptr = sql ; *ptr ; ) {
+		if ( isspace( (unsigned char)*ptr ) ) {
+			while ( isspace( (unsigned char)*ptr ) )
+				ptr++;
+			if ( optr != out && *ptr )
+				*optr++ = ' ';
+		}
+		else if ( *ptr == '\'' ) {
+			for ( ptr++ ; *ptr && !(*ptr == '\'' && ptr[1] != '\'') ; ptr++ )
+				if ( *ptr == '\'' )
+					ptr++;
+			if ( *ptr )
+				ptr++;
+			*optr++ = '?';
+		}
+		else if ( isdigit( (unsigned char)*ptr ) && (optr == out || !(isalnum( (unsigned char)optr[-1] ) || optr[-1] == '_')) ) {
+			while ( isalnum( (unsigned char)*ptr ) || *ptr == '.' )
+				ptr++;
+			*optr++ = '?';
+		}
+		else
+			*optr++ = *ptr++;
+	}
+
+	NSString *normalized = OO_AUTORELEASE( [[NSString alloc] initWithBytes:out length:optr-out
+																encoding:NSUTF8StringEncoding] );
+	free( out );
+	return normalized ? normalized : [NSString stringWithUTF8String:sql];
+}
+
+/**
+ Statistics kept for each normalized statement.
+ */
+
+@interface OOSqlStatistics : NSObject {
+@public
+	struct _ooTimings prepare, step;
+	long rows, changes;
+}
+@end
+
+@implementation OOSqlStatistics
+@end
+
+@implementation OOSqlProfile
+
+- init {
+	if ( self = [super init] )
+		rowCounts = CFDictionaryCreateMutable( NULL, 0, NULL, NULL );
+	return self;
+}
+
+- (OOSqlStatistics *)statisticsFor:(const char *)sql {
+	NSString *key = ooNormalizeSql( sql );
+	OOSqlStatistics *stats = *statistics[key];
+	if ( !stats )
+		OO_RELEASE( statistics[key] = stats = [[OOSqlStatistics alloc] init] );
+	return stats;
+}
+
+- (void)sql:(const char *)sql prepared:(sqlite3_int64)ns {
+	@synchronized( self ) {
+		ooAddTiming( [self statisticsFor:sql]->prepare, ns );
+	}
+}
+
+- (void)countRowOf:(sqlite3_stmt *)stmt {
+	@synchronized( self ) {
+		CFDictionarySetValue( rowCounts, stmt, (const void *)((long)CFDictionaryGetValue( rowCounts, stmt ) + 1) );
+	}
+}
+
+- (void)sql:(const char *)sql ofStatement:(sqlite3_stmt *)stmt ran:(sqlite3_int64)ns {
+	int changes = stmt && !sqlite3_stmt_readonly( stmt ) ? sqlite3_changes( sqlite3_db_handle( stmt ) ) : 0;
+	@autoreleasepool {
+		@synchronized( self ) {
+			OOSqlStatistics *stats = [self statisticsFor:sql];
+			ooAddTiming( stats->step, ns );
+			stats->rows += (long)CFDictionaryGetValue( rowCounts, stmt );
+			stats->changes += changes;
+			CFDictionaryRemoveValue( rowCounts, stmt );
+		}
+	}
+}
+
+- (OODictionary<NSDictionary *>)statistics {
+	OODictionary<NSDictionary *> out;
+	@synchronized( self ) {
+		for ( NSString *sql in [*statistics allKeys] ) {
+			OOSqlStatistics *stats = *statistics[sql];
+			out[sql] = [NSDictionary dictionaryWithObjectsAndKeys:
+						ooTimingsDictionary( stats->prepare ), @"prepare",
+						ooTimingsDictionary( stats->step ), @"step",
+						[NSNumber numberWithLong:stats->rows], @"rows",
+						[NSNumber numberWithLong:stats->changes], @"changes", nil];
+		}
+	}
+	return out;
+}
+
+- (void)reset {
+	@synchronized( self ) {
+		statistics = nil;
+		CFDictionaryRemoveAllValues( rowCounts );
+	}
+}
+
+- (void)dealloc {
+	CFRelease( rowCounts );
+	OO_DEALLOC( super );
+}
+
+@end
+
+#if SQLITE_VERSION_NUMBER >= 3014000
+static int ooTraceCallback( unsigned type, void *context, void *p, void *x ) {
+	OOSqlProfile *profile = OO_BRIDGE(OOSqlProfile *)context;
+	sqlite3_stmt *stmt = (sqlite3_stmt *)p;
+
+	if ( type == SQLITE_TRACE_ROW )
+		[profile countRowOf:stmt];
+	else if ( type == SQLITE_TRACE_PROFILE )
+		[profile sql:sqlite3_sql( stmt ) ofStatement:stmt ran:*(sqlite3_int64 *)x];
+	return 0;
+}
+#else
+static void ooProfileCallback( void *context, const char *sql, sqlite3_uint64 ns ) {
+	[OO_BRIDGE(OOSqlProfile *)context sql:sql ofStatement:NULL ran:(sqlite3_int64)ns];
+}
+#endif
+
+#pragma mark OOChangeFeed - rows changed by each commit for subscribers
+
+@implementation OOTableChanges
+
+- init {
+	if ( (self = [super init]) ) {
+		inserted = [NSMutableIndexSet indexSet];
+		updated = [NSMutableIndexSet indexSet];
+		deleted = [NSMutableIndexSet indexSet];
+	}
+	return self;
+}
+
+- (void)row:(sqlite3_int64)rowid changedBy:(int)op {
+	// an index set can only hold rowids from 0 to NSNotFound-1
+	if ( rowid < 0 || (unsigned long long)rowid >= NSNotFound ) {
+		OOWarn( @"-[OOTableChanges row:changedBy:] Rowid %lld out of range for change notification", (long long)rowid );
+		return;
+	}
+	NSUInteger row = (NSUInteger)rowid;
+	switch ( op ) {
+		case SQLITE_INSERT:
+			// a rowid deleted then inserted again has been replaced
+			if ( [*deleted containsIndex:row] ) {
+				[*deleted removeIndex:row];
+				[*updated addIndex:row];
+			}
+			else
+				[*inserted addIndex:row];
+			break;
+		case SQLITE_UPDATE:
+			if ( ![*inserted containsIndex:row] )
+				[*updated addIndex:row];
+			break;
+		case SQLITE_DELETE:
+			if ( [*inserted containsIndex:row] )
+				[*inserted removeIndex:row];
+			else {
+				[*updated removeIndex:row];
+				[*deleted addIndex:row];
+			}
+			break;
+	}
+}
+
+- (void)merge:(OOTableChanges *)changes {
+	for ( NSUInteger row=[*changes->deleted firstIndex] ; row != NSNotFound ; row=[*changes->deleted indexGreaterThanIndex:row] )
+		[self row:row changedBy:SQLITE_DELETE];
+	for ( NSUInteger row=[*changes->inserted firstIndex] ; row != NSNotFound ; row=[*changes->inserted indexGreaterThanIndex:row] )
+		[self row:row changedBy:SQLITE_INSERT];
+	for ( NSUInteger row=[*changes->updated firstIndex] ; row != NSNotFound ; row=[*changes->updated indexGreaterThanIndex:row] )
+		[self row:row changedBy:SQLITE_UPDATE];
+}
+
+- (BOOL)isEmpty {
+	return ![*inserted count] && ![*updated count] && ![*deleted count];
+}
+
+@end
+
+@implementation OOChangeSubscription
+
+- initTable:(cOOString)aTableName queue:(dispatch_queue_t)aQueue handler:(OOChangeHandler)aHandler {
+	if ( (self = [super init]) ) {
+		tableName = [*aTableName lowercaseString];
+		queue = aQueue;
+#ifndef OO_ARC
+		dispatch_retain( queue );
+#endif
+		handler = [aHandler copy];
+	}
+	return self;
+}
+
+/**
+ Schedule a call of the handler with changes unless one is already waiting to be made
+ in which case the changes are merged into it.
+ */
+
+- (void)deliver:(OOTableChanges *)changes {
+	@synchronized( self ) {
+		BOOL scheduled = !!waiting;
+		if ( !scheduled )
+			OO_RELEASE( waiting = [[OOTableChanges alloc] init] );
+		[*waiting merge:changes];
+		if ( scheduled )
+			return;
+	}
+
+	dispatch_async( queue, ^{
+		OOReference<OOTableChanges *> batch;
+		@synchronized( self ) {
+			batch = waiting;
+			waiting = nil;
+		}
+		if ( ![*batch isEmpty] )
+			handler( *batch->inserted, *batch->updated, *batch->deleted );
+	} );
+}
+
+- (void)dealloc {
+#ifndef OO_ARC
+	dispatch_release( queue );
+#endif
+	OO_RELEASE( handler );
+	OO_DEALLOC( super );
+}
+
+@end
+
+@implementation OOChangeFeed
+
+/**
+ Called from the update hook for every row changed on the writer connection. The changes
+ for the table last changed are remembered as consecutive rows are usually of one table.
+ */
+
+- (void)row:(sqlite3_int64)rowid ofTable:(const char *)table changedBy:(int)op {
+	if ( strncmp( table, lastTable, sizeof lastTable ) != 0 ) {
+		NSString *name = [[NSString stringWithUTF8String:table] lowercaseString];
+		lastChanges = nil;
+		for ( OOChangeSubscription *subscription in *subscriptions )
+			if ( subscription->tableName == name ) {
+				if ( !(lastChanges = pending[name]) )
+					OO_RELEASE( pending[name] = lastChanges = [[OOTableChanges alloc] init] );
+				break;
+			}
+		strlcpy( lastTable, table, sizeof lastTable );
+	}
+	[lastChanges row:rowid changedBy:op];
+}
+
+/**
+ Called from the commit hook before the commit has completed. The changes are kept
+ back until the database sees it has succeeded in case it fails.
+ */
+
+- (void)stage {
+	for ( NSString *name in [*pending allKeys] ) {
+		OOTableChanges *changes = staged[name];
+		if ( changes )
+			[changes merge:*pending[name]];
+		else
+			staged[name] = *pending[name];
+	}
+	pending = nil;
+	lastChanges = nil;
+	lastTable[0] = 0;
+}
+
+- (void)publish {
+	if ( !staged )
+		return;
+	for ( OOChangeSubscription *subscription in *subscriptions ) {
+		OOTableChanges *changes = staged[subscription->tableName];
+		if ( changes && ![changes isEmpty] )
+			[subscription deliver:changes];
+	}
+	staged = nil;
+}
+
+- (void)discard {
+	pending = nil;
+	staged = nil;
+	lastChanges = nil;
+	lastTable[0] = 0;
+}
+
+@end
+
+static void ooUpdateHook( void *context, int op, const char *database, const char *table, sqlite3_int64 rowid ) {
+	[OO_BRIDGE(OOChangeFeed *)context row:rowid ofTable:table changedBy:op];
+}
+
+static int ooCommitHook( void *context ) {
+	[OO_BRIDGE(OOChangeFeed *)context stage];
+	return 0;
+}
+
+static void ooRollbackHook( void *context ) {
+	[OO_BRIDGE(OOChangeFeed *)context discard];
+}
+
+#pragma mark OOArrayTable - virtual table over an array of records in memory
+
+@implementation OOArrayTable
+
+- initArray:(const OOArray<id> &)anArray metaData:(OOMetaData *)aMetaData {
+	if ( (self = [super init]) ) {
+		records = anArray;
+		metaData = aMetaData;
+		columnPlan = (int *)malloc( (metaData->nplan+1) * sizeof *columnPlan );
+
+		OOStringArray declared;
+		for ( int p=0 ; p<metaData->nplan ; p++ ) {
+			const struct _ooIvarPlan &entry = metaData->plan[p];
+			if ( entry.rowid )
+				continue;
+			const char *type = entry.text ? "text" : entry.date || strchr( "fd", entry.type ) ? "real" :
+				strchr( "cCsSiIlLqQ", entry.type ) ? "int" : "blob";
+			declared += OOFormat( @"%s %s", entry.name, type );
+			columnPlan[ncolumns++] = p;
+		}
+		schema = OOFormat( @"create table x (%@)", *(declared/", ") );
+	}
+	return self;
+}
+
+- (BOOL)isIndexed:(int)column {
+	const char *name = metaData->plan[columnPlan[column]].name;
+	return iswupper( name[name[0] != '_' ? 0 : 1] );
+}
+
+/**
+ Rows of the array for each value of a column. Rows where it is null are left out.
+ */
+
+- (NSMutableDictionary *)newIndexForColumn:(int)column {
+	NSMutableDictionary *index = [[NSMutableDictionary alloc] init];
+	NSUInteger nrows = [*records count];
+	for ( NSUInteger row=0 ; row<nrows ; row++ ) {
+		id value = [metaData valueForPlan:columnPlan[column] ofRecord:[*records objectAtIndex:row]];
+		if ( value == OONull )
+			continue;
+		NSMutableIndexSet *rows = [index objectForKey:value];
+		if ( !rows )
+			[index setObject:rows = [NSMutableIndexSet indexSet] forKey:value];
+		[rows addIndex:row];
+	}
+	return index;
+}
+
+- (void)result:(sqlite3_context *)context column:(int)column row:(NSUInteger)row {
+	id value = [metaData valueForPlan:columnPlan[column] ofRecord:[*records objectAtIndex:row]];
+
+	if ( value == OONull )
+		sqlite3_result_null( context );
+	else if ( [value isKindOfClass:[NSNumber class]] ) {
+		const char *type = [(NSNumber *)value objCType];
+		if ( *type == 'f' || *type == 'd' )
+			sqlite3_result_double( context, [value doubleValue] );
+		else
+			sqlite3_result_int64( context, [value longLongValue] );
+	}
+	else if ( [value isKindOfClass:[NSData class]] )
+		sqlite3_result_blob( context, [value bytes], (int)[value length], SQLITE_TRANSIENT );
+	else
+		sqlite3_result_text( context, [[value description] UTF8String], -1, SQLITE_TRANSIENT );
+}
+
+- (void)dealloc {
+	free( columnPlan );
+	OO_DEALLOC( super );
+}
+
+@end
+
+/**
+ Key to look up the value of a constraint in the index of an OOArrayTable.
+ */
+
+static id ooValueKey( sqlite3_value *value ) {
+	switch ( sqlite3_value_type( value ) ) {
+		case SQLITE_INTEGER:
+			return [NSNumber numberWithLongLong:sqlite3_value_int64( value )];
+		case SQLITE_FLOAT:
+			return [NSNumber numberWithDouble:sqlite3_value_double( value )];
+		case SQLITE_TEXT:
+			return OO_AUTORELEASE( [[NSString alloc] initWithBytes:sqlite3_value_text( value )
+															length:sqlite3_value_bytes( value )
+														  encoding:NSUTF8StringEncoding] );
+		case SQLITE_BLOB:
+			return [NSData dataWithBytes:sqlite3_value_blob( value ) length:sqlite3_value_bytes( value )];
+		default:
+			return nil;
+	}
+}
+
+/**
+ Key for a constraint value with the affinity of the column it is compared with applied
+ as sqlite would: text that looks like a number matches an int or real column and a
+ number matches a text column by its text.
+ */
+
+static id ooConstraintKey( sqlite3_value *value, const struct _ooIvarPlan &plan ) {
+	int type = sqlite3_value_type( value );
+	if ( !plan.text && (plan.date || strchr( "fdcCsSiIlLqQ", plan.type )) && type == SQLITE_TEXT )
+		sqlite3_value_numeric_type( value );
+	else if ( plan.text && (type == SQLITE_INTEGER || type == SQLITE_FLOAT) )
+		return [NSString stringWithUTF8String:(const char *)sqlite3_value_text( value )];
+	return ooValueKey( value );
+}
+
+struct _ooArrayVtab {
+	sqlite3_vtab base;
+	CFTypeRef table;
+};
+
+struct _ooArrayCursor {
+	sqlite3_vtab_cursor base;
+	CFTypeRef table, index, rows;
+	int indexColumn;
+	NSUInteger row;
+};
+
+static int ooArrayConnect( sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **error ) {
+	NSMutableDictionary *tables = OO_BRIDGE(NSMutableDictionary *)aux;
+	OOArrayTable *table;
+	@synchronized( tables ) {
+		table = [tables objectForKey:[[NSString stringWithUTF8String:argv[2]] lowercaseString]];
+	}
+	if ( !table ) {
+		*error = sqlite3_mprintf( "No array registered for table %s", argv[2] );
+		return SQLITE_ERROR;
+	}
+
+	int errcode = sqlite3_declare_vtab( db, table->schema );
+	if ( errcode != SQLITE_OK )
+		return errcode;
+
+	struct _ooArrayVtab *arrayVtab = (struct _ooArrayVtab *)sqlite3_malloc( sizeof *arrayVtab );
+	memset( arrayVtab, 0, sizeof *arrayVtab );
+	arrayVtab->table = CFRetain( OO_BRIDGE(CFTypeRef)table );
+	*vtab = &arrayVtab->base;
+	return SQLITE_OK;
+}
+
+static int ooArrayDisconnect( sqlite3_vtab *vtab ) {
+	CFRelease( ((struct _ooArrayVtab *)vtab)->table );
+	sqlite3_free( vtab );
+	return SQLITE_OK;
+}
+
+/**
+ Use the first equality constraint on an indexed column to look rows up rather than scan.
+ */
+
+static int ooArrayBestIndex( sqlite3_vtab *vtab, sqlite3_index_info *info ) {
+	OOArrayTable *table = OO_BRIDGE(OOArrayTable *)((struct _ooArrayVtab *)vtab)->table;
+	info->estimatedCost = (double)[*table->records count] + 1.;
+
+	for ( int c=0 ; c<info->nConstraint ; c++ )
+		if ( info->aConstraint[c].usable && info->aConstraint[c].op == SQLITE_INDEX_CONSTRAINT_EQ &&
+			info->aConstraint[c].iColumn >= 0 && [table isIndexed:info->aConstraint[c].iColumn] ) {
+			info->aConstraintUsage[c].argvIndex = 1;
+			info->idxNum = info->aConstraint[c].iColumn + 1;
+			info->estimatedCost = 10.;
+			break;
+		}
+
+	return SQLITE_OK;
+}
+
+static int ooArrayOpen( sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor ) {
+	struct _ooArrayCursor *arrayCursor = (struct _ooArrayCursor *)sqlite3_malloc( sizeof *arrayCursor );
+	memset( arrayCursor, 0, sizeof *arrayCursor );
+	arrayCursor->table = CFRetain( ((struct _ooArrayVtab *)vtab)->table );
+	arrayCursor->indexColumn = -1;
+	*cursor = &arrayCursor->base;
+	return SQLITE_OK;
+}
+
+static int ooArrayClose( sqlite3_vtab_cursor *cursor ) {
+	struct _ooArrayCursor *arrayCursor = (struct _ooArrayCursor *)cursor;
+	CFRelease( arrayCursor->table );
+	if ( arrayCursor->index )
+		CFRelease( arrayCursor->index );
+	if ( arrayCursor->rows )
+		CFRelease( arrayCursor->rows );
+	sqlite3_free( arrayCursor );
+	return SQLITE_OK;
+}
+
+/**
+ Start a scan of all rows or of the rows with a value of an indexed column. The index
+ is kept by the cursor so it is built once for each query rather than for each lookup
+ made when the table is the inner table of a join.
+ */
+
+static int ooArrayFilter( sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv ) {
+	struct _ooArrayCursor *arrayCursor = (struct _ooArrayCursor *)cursor;
+	OOArrayTable *table = OO_BRIDGE(OOArrayTable *)arrayCursor->table;
+
+	if ( arrayCursor->rows )
+		CFRelease( arrayCursor->rows );
+	arrayCursor->rows = NULL;
+	arrayCursor->row = 0;
+
+	if ( idxNum > 0 && argc > 0 ) {
+		@autoreleasepool {
+			if ( arrayCursor->indexColumn != idxNum-1 ) {
+				if ( arrayCursor->index )
+					CFRelease( arrayCursor->index );
+				arrayCursor->index = OO_BRIDGE(CFTypeRef)[table newIndexForColumn:idxNum-1];
+#ifdef OO_ARC
+				CFRetain( arrayCursor->index );
+#endif
+				arrayCursor->indexColumn = idxNum-1;
+			}
+
+			id key = ooConstraintKey( argv[0], table->metaData->plan[table->columnPlan[idxNum-1]] );
+			NSIndexSet *rows = key ? [OO_BRIDGE(NSDictionary *)arrayCursor->index objectForKey:key] : nil;
+			if ( !rows )
+				rows = [NSIndexSet indexSet];
+			arrayCursor->rows = CFRetain( OO_BRIDGE(CFTypeRef)rows );
+			arrayCursor->row = [rows firstIndex];
+		}
+	}
+
+	return SQLITE_OK;
+}
+
+static int ooArrayNext( sqlite3_vtab_cursor *cursor ) {
+	struct _ooArrayCursor *arrayCursor = (struct _ooArrayCursor *)cursor;
+	if ( arrayCursor->rows )
+		arrayCursor->row = [OO_BRIDGE(NSIndexSet *)arrayCursor->rows indexGreaterThanIndex:arrayCursor->row];
+	else
+		arrayCursor->row++;
+	return SQLITE_OK;
+}
+
+static int ooArrayEof( sqlite3_vtab_cursor *cursor ) {
+	struct _ooArrayCursor *arrayCursor = (struct _ooArrayCursor *)cursor;
+	OOArrayTable *table = OO_BRIDGE(OOArrayTable *)arrayCursor->table;
+	return arrayCursor->rows ? arrayCursor->row == NSNotFound : arrayCursor->row >= [*table->records count];
+}
+
+static int ooArrayColumn( sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column ) {
+	struct _ooArrayCursor *arrayCursor = (struct _ooArrayCursor *)cursor;
+	@autoreleasepool {
+		[OO_BRIDGE(OOArrayTable *)arrayCursor->table result:context column:column row:arrayCursor->row];
+	}
+	return SQLITE_OK;
+}
+
+static int ooArrayRowid( sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid ) {
+	*rowid = (sqlite3_int64)((struct _ooArrayCursor *)cursor)->row;
+	return SQLITE_OK;
+}
+
+// read-only: the entries from xUpdate on are left null
+static sqlite3_module ooArrayModule = {
+	0, ooArrayConnect, ooArrayConnect, ooArrayBestIndex, ooArrayDisconnect, ooArrayDisconnect,
+	ooArrayOpen, ooArrayClose, ooArrayFilter, ooArrayNext, ooArrayEof, ooArrayColumn, ooArrayRowid
+};
+
+static sqlite3_int64 ooNanoseconds() {
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (sqlite3_int64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#pragma mark OOAdaptor - implements all access to a particular database 
+
+@implementation OOAdaptor 
+
+/**
+ Connect to/create sqlite3 database
+ */
+
+- (OOAdaptor *)initPath:(cOOString)path database:(OODatabase *)aDatabase {
+    if ( self = [super init] ) {
+        owner = database = aDatabase;
+        OOFile( OOFile( path ).dir() ).mkdir();
+        if ( (owner->errcode = sqlite3_open( path, &db )) != SQLITE_OK ) {
+            OOWarn( @"-[OOAdaptor initPath:database:] Error opening database at path: %@", *path );
+            return nil;
+        }
+    }
+	return self;
+}
+
+/**
+ Open a read-only connection to the same database file as a writer for the reader pool.
+ Errors are recorded in a status object of its own rather than the writer's database.
+ */
+
+- initReaderFor:(OOAdaptor *)writer {
+	if ( self = [super init] ) {
+		OO_RELEASE( status = [[OODatabase alloc] init] );
+		owner = *status;
+		database = writer->database;
+		if ( (owner->errcode = sqlite3_open_v2( sqlite3_db_filename( writer->db, "main" ), &db,
+											   SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX, NULL )) != SQLITE_OK ) {
+			OOWarn( @"-[OOAdaptor initReaderFor:] Error opening reader - %s", sqlite3_errmsg( db ) );
+			sqlite3_close( db );
+			OO_RELEASE( self );
+			return nil;
+		}
+		[self setBusyTimeout:OOSQL_BUSY_TIMEOUT];
+	}
+	return self;
+}
+
+/**
+ Prepare a sql statement after which values can be bound and results returned.
+ Statements are kept in a least recently used cache keyed by their SQL text
+ and reset rather than finalized so identical SQL is only compiled once.
+ */
+
+- (BOOL)prepare:(cOOString)sql {
+	NSString *key = OO_AUTORELEASE( [*sql copy] );
+	NSValue *cached = *stmtCache[key];
+	owner->lastSQL = sql;
+
+	if ( cached ) {
+		stmt = (sqlite3_stmt *)[cached pointerValue];
+		sqlite3_reset( stmt );
+		sqlite3_clear_bindings( stmt );
+		stmtLRU -= key;
+		stmtLRU += key;
+		stmtCached = YES;
+		cacheHits++;
+		owner->errcode = SQLITE_OK;
+		return YES;
+	}
+
+	cacheMisses++;
+	sqlite3_int64 started = !!profile ? ooNanoseconds() : 0;
+	if ( (owner->errcode = sqlite3_prepare_v2( db, sql, -1, &stmt, 0 )) != SQLITE_OK ) {
+		OOWarn(@"-[OOAdaptor prepare:] Could not prepare sql: \"%@\" - %s", *owner->lastSQL, owner->errmsg = (char *)sqlite3_errmsg( db ) );
+		return NO;
+	}
+	if ( started )
+		[*profile sql:sqlite3_sql( stmt ) prepared:ooNanoseconds() - started];
+
+	if ( (stmtCached = OOSQL_STMT_CACHE_SIZE > 0) ) {
+		if ( stmtLRU >= OOSQL_STMT_CACHE_SIZE ) {
+			OOString oldest = --stmtLRU;
+			sqlite3_finalize( (sqlite3_stmt *)[*~stmtCache[oldest] pointerValue] );
+			cacheEvictions++;
+		}
+		stmtCache[key] = [NSValue valueWithPointer:stmt];
+		stmtLRU += key;
+	}
+
+	return YES;
+}
+
+/**
+ Release the current statement after use. Cached statements are reset for reuse.
+ */
+
+- (void)finishStatement {
+	if ( stmtCached ) {
+		sqlite3_reset( stmt );
+		sqlite3_clear_bindings( stmt );
+	}
+	else
+		sqlite3_finalize( stmt );
+	stmt = NULL;
+}
+
+/**
+ Bump allocate bytes for a parameter from the current arena block. Blocks are never
+ moved so earlier parameters remain valid until the arena is reset for the next statement.
+ */
+
+- (char *)arenaAlloc:(size_t)size {
+	if ( !arena || arena->used + size > arena->size ) {
+		size_t blockSize = MAX( size, OOSQL_BIND_ARENA_BLOCK );
+		struct _ooArenaBlock *block = (struct _ooArenaBlock *)malloc( sizeof *block + blockSize );
+		block->next = arena;
+		block->size = blockSize;
+		block->used = 0;
+		arena = block;
+		arenaMallocs++;
+	}
+
+	char *bytes = arena->bytes + arena->used;
+	arena->used += size;
+	return bytes;
+}
+
+/**
+ Release parameters bound for the statement just executed keeping one arena block for reuse.
+ */
+
+- (void)resetArena {
+	while ( arena && arena->next ) {
+		struct _ooArenaBlock *next = arena->next;
+		free( arena );
+		arena = next;
+	}
+	if ( arena )
+		arena->used = 0;
+	[*bound removeAllObjects];
+}
+
+- (int)bindValue:(id)value asParameter:(int)pno {
+#ifdef OODEBUG_BIND
+	NSLog( @"-[OOAdaptor bindValue:bindValue:] bind parameter #%d as: %@", pno, value );
+#endif
+	if ( !value || value == OONull )
+		return sqlite3_bind_null( stmt, pno );
+//#define OOSQL_THREAD_SAFE_BUT_USES_MORE_MEMORY
+#ifdef OOSQL_THREAD_SAFE_BUT_USES_MORE_MEMORY
+	else if ( [value isKindOfClass:[NSString class]] )
+		return sqlite3_bind_text( stmt, pno, [value UTF8String], -1, SQLITE_STATIC );
+#else
+	else if ( transientBinds && [value isKindOfClass:[NSString class]] )
+		return sqlite3_bind_text( stmt, pno, [value UTF8String], -1, SQLITE_TRANSIENT );
+	else if ( [value isKindOfClass:[NSString class]] ) {
+		// bind the string's own UTF-8 buffer when it has one, retaining it until reset
+		const char *utf8 = CFStringGetCStringPtr( OO_BRIDGE(CFStringRef)value, kCFStringEncodingUTF8 );
+		if ( utf8 ) {
+			bound += value;
+			bindNoCopy++;
+			return sqlite3_bind_text( stmt, pno, utf8, -1, SQLITE_STATIC );
+		}
+
+		NSUInteger max = [value maxLengthOfBytesUsingEncoding:NSUTF8StringEncoding] + 1;
+		char *str = [self arenaAlloc:max];
+		[value getCString:str maxLength:max encoding:NSUTF8StringEncoding];
+		size_t len = strlen( str );
+		arena->used -= max - (len + 1);
+		bindArenaCopies++;
+		return sqlite3_bind_text( stmt, pno, str, (int)len, SQLITE_STATIC );
+	}
+#endif
+	else if ( [value isKindOfClass:[NSData class]] ) {
+		if ( !transientBinds )
+			bound += value;
+		return sqlite3_bind_blob( stmt, pno, [value bytes], (int)[value length],
+								 transientBinds ? SQLITE_TRANSIENT : SQLITE_STATIC );
+	}
+
+	const char *type = [value objCType];
+	if ( type )
+		switch ( type[0] ) {
+			case 'c': case 's': case 'i': case 'l':
+			case 'C': case 'S': case 'I': case 'L':
+				return sqlite3_bind_int( stmt, pno, [value intValue] );
+			case 'q': case 'Q':
+				return sqlite3_bind_int64( stmt, pno, [value longLongValue] );
+			case 'f': case 'd':
+				return sqlite3_bind_double( stmt, pno, [value doubleValue] );
+		}
+
+	OOWarn( @"-[OOAdaptor bindValue:bindValue:] Undefined type in bind of parameter #%d: %s, value: %@", pno, type, value );
+	return -1;
+}
+
+/**
+ Bind parameters from a prepared SQL statement. The "objCType" method is used to determine the type to bind.
+ */
+
+- (BOOL)bindCols:(cOOStringArray)columns values:(cOOValueDictionary)values startingAt:(int)pno bindNulls:(BOOL)bindNulls {
+	int errcode;
+	for ( NSString *name in *columns )
+		if ( bindNulls || *values[name] != OONull )
+			if ( (errcode = [self bindValue:values[name] asParameter:pno++]) != SQLITE_OK )
+				OOWarn( @"-[OOAdaptor bindCols:...] Bind failed column: %@ - %s (%d)", name, owner->errmsg = (char *)sqlite3_errmsg( db ), owner->errcode = errcode );
+	return owner->errcode == SQLITE_OK;
+}
+
+/**
+ Return a dictionary containing the values for a row returned by the database from a select.
+ These values need to be decoded using a classes metadata to set the ivar values later.
+ */
+
+- (OOValueDictionary)valuesForRow:(sqlite3_stmt *)row {
+	int ncols = sqlite3_column_count( row );
+	OOValueDictionary values;
+
+	for ( int i=0 ; i<ncols ; i++ ) {
+		id value = [self newValueForColumn:i ofRow:row];
+		values[sqlite3_column_name( row, i )] = value;
+		OO_RELEASE( value );
+	}
+
+	return values;
+}
+
+- (id)newValueForColumn:(int)i ofRow:(sqlite3_stmt *)row OO_RETURNS {
+	switch ( sqlite3_column_type( row, i ) ) {
+		case SQLITE_NULL:
+			return OO_RETAIN( OONull );
+		case SQLITE_INTEGER:
+			return [[NSNumber alloc] initWithLongLong:sqlite3_column_int64( row, i )];
+		case SQLITE_FLOAT:
+			return [[NSNumber alloc] initWithDouble:sqlite3_column_double( row, i )];
+		case SQLITE_TEXT: {
+			const unsigned char *bytes = sqlite3_column_text( row, i );
+			return [[NSMutableString alloc] initWithBytes:bytes
+												   length:sqlite3_column_bytes( row, i )
+												 encoding:NSUTF8StringEncoding];
+		}
+		case SQLITE_BLOB: {
+			const void *bytes = sqlite3_column_blob( row, i );
+			return [[NSData alloc] initWithBytes:bytes length:sqlite3_column_bytes( row, i )];
+		}
+		default:
+			OOWarn( @"-[OOAdaptor valuesForRow:] Invalid type on bind of ivar %s: %d",
+				   sqlite3_column_name( row, i ), sqlite3_column_type( row, i ) );
+			return nil;
+	}
+}
+
+/**
+ Map the columns of a statement onto the ivar plan of a class. Entries are -1 where the
+ value must be set using key value coding. The result is malloced and must be freed.
+ */
+
+- (int *)newColumnMapForRow:(sqlite3_stmt *)row metaData:(OOMetaData *)metaData {
+	int ncols = sqlite3_column_count( row ), *map = (int *)malloc( (ncols+1) * sizeof *map );
+
+	for ( int i=0 ; i<ncols ; i++ ) {
+		const char *name = sqlite3_column_name( row, i );
+		map[i] = -1;
+		for ( int p=0 ; p<metaData->nplan ; p++ )
+			if ( strcmp( name, metaData->plan[p].name ) == 0 ) {
+				if ( metaData->plan[p].setDirect )
+					map[i] = p;
+				break;
+			}
+	}
+
+	return map;
+}
+
+static void ooSetObjectIvar( id record, ptrdiff_t offset, id value ) {
+	CFTypeRef *slot = (CFTypeRef *)((char *)OO_BRIDGE(void *)record + offset), old = *slot;
+	*slot = value ? CFRetain( OO_BRIDGE(CFTypeRef)value ) : NULL;
+	if ( old && old != kCFNull )
+		CFRelease( old );
+}
+
+/**
+ Write the value of a column straight into the ivar of a record using its plan.
+ */
+
+- (void)setColumn:(int)i ofRow:(sqlite3_stmt *)row into:(id)record plan:(const struct _ooIvarPlan &)plan {
+	void *ivar = (char *)OO_BRIDGE(void *)record + plan.offset;
+
+	switch ( plan.type ) {
+		case 'c': *(char *)ivar = (char)sqlite3_column_int( row, i ); return;
+		case 'C': *(unsigned char *)ivar = (unsigned char)sqlite3_column_int( row, i ); return;
+		case 's': *(short *)ivar = (short)sqlite3_column_int( row, i ); return;
+		case 'S': *(unsigned short *)ivar = (unsigned short)sqlite3_column_int( row, i ); return;
+		case 'i': case 'l': *(int *)ivar = sqlite3_column_int( row, i ); return;
+		case 'I': case 'L': *(unsigned *)ivar = (unsigned)sqlite3_column_int64( row, i ); return;
+		case 'q': case 'Q': *(long long *)ivar = sqlite3_column_int64( row, i ); return;
+		case 'f': *(float *)ivar = (float)sqlite3_column_double( row, i ); return;
+		case 'd': *(double *)ivar = sqlite3_column_double( row, i ); return;
+	}
+
+	if ( sqlite3_column_type( row, i ) == SQLITE_NULL )
+		return ooSetObjectIvar( record, plan.offset, nil );
+
+	id value;
+	if ( plan.date )
+		value = OO_RETAIN( [NSDate dateWithTimeIntervalSince1970:sqlite3_column_double( row, i )] );
+	else if ( plan.text ) {
+		const unsigned char *bytes = sqlite3_column_text( row, i );
+		value = [[NSMutableString alloc] initWithBytes:bytes length:sqlite3_column_bytes( row, i )
+											  encoding:NSUTF8StringEncoding];
+	}
+	else {
+		const void *bytes = sqlite3_column_blob( row, i );
+		value = [[NSData alloc] initWithBytes:bytes length:sqlite3_column_bytes( row, i )];
+		if ( plan.archived ) {
+			id data = value;
+			value = OO_RETAIN( [plan.codec decodeColumnData:data] );
+			OO_RELEASE( data );
+		}
+	}
+
+	ooSetObjectIvar( record, plan.offset, value );
+	OO_RELEASE( value );
+}
+
+/**
+ Key identifying the record a row is for in the identity map: the class with the values
+ of its ooTableKey columns or rowid. nil if the row does not include them all.
+ */
+
+- (NSString *)identityForRow:(sqlite3_stmt *)row metaData:(OOMetaData *)metaData columnMap:(const int *)map {
+	int ncols = sqlite3_column_count( row ), nkeys = 0;
+	NSMutableString *identity = [NSMutableString stringWithString:*metaData->recordClassName];
+
+	for ( int i=0 ; i<ncols ; i++ ) {
+		if ( map[i] < 0 || !(!!metaData->keys ? metaData->plan[map[i]].key : metaData->plan[map[i]].rowid) )
+			continue;
+		if ( sqlite3_column_type( row, i ) == SQLITE_NULL )
+			return nil;
+		[identity appendFormat:@"\t%s", sqlite3_column_text( row, i )];
+		nkeys++;
+	}
+
+	return nkeys == (!!metaData->keys ? (int)metaData->keys : 1) ? identity : nil;
+}
+
+/**
+ Create an instance of the recordClass from the current row of a statement or if
+ the record class is not present return a dictionary with the raw results. With an
+ identity map an instance already in memory for the row is returned instead.
+ */
+
+- (id)newObjectForRow:(sqlite3_stmt *)row ofClass:(Class)recordClass
+			 metaData:(OOMetaData *)metaData columnMap:(const int *)map OO_RETURNS {
+	if ( !recordClass )
+		return OO_RETAIN( [self valuesForRow:row].get() );
+
+	NSString *identity = identityMap && map ? [self identityForRow:row metaData:metaData columnMap:map] : nil;
+	if ( identity )
+		@synchronized( identityMap ) {
+			id existing = [identityMap objectForKey:identity];
+			if ( existing )
+				return OO_RETAIN( existing );
+		}
+
+	id record = [[recordClass alloc] init];
+	int ncols = sqlite3_column_count( row );
+	OOValueDictionary values;
+
+	for ( int i=0 ; i<ncols ; i++ )
+		if ( map && map[i] >= 0 )
+			[self setColumn:i ofRow:row into:record plan:metaData->plan[map[i]]];
+		else {
+			id value = [self newValueForColumn:i ofRow:row];
+			values[sqlite3_column_name( row, i )] = value;
+			OO_RELEASE( value );
+		}
+
+	// columns without a direct plan still go through key value coding
+	if ( !!values )
+		[record setValuesForKeysWithDictionary:[metaData decode:values]];
+
+	// deferred columns not selected are loaded by their getter when first used
+	if ( !!metaData->deferredColumns ) {
+		NSMutableIndexSet *unloaded = [NSMutableIndexSet indexSet];
+		for ( int p=0 ; p<metaData->nplan ; p++ )
+			if ( metaData->plan[p].deferred )
+				[unloaded addIndex:p];
+		for ( int i=0 ; i<ncols ; i++ )
+			for ( int p=0 ; p<metaData->nplan ; p++ )
+				if ( metaData->plan[p].deferred && strcmp( sqlite3_column_name( row, i ), metaData->plan[p].name ) == 0 )
+					[unloaded removeIndex:p];
+		if ( [unloaded count] ) {
+			objc_setAssociatedObject( record, &kOOUnloadedKey, unloaded, OBJC_ASSOCIATION_RETAIN_NONATOMIC );
+			objc_setAssociatedObject( record, &kOODatabaseKey, database, OBJC_ASSOCIATION_RETAIN_NONATOMIC );
+		}
+	}
+	if ( [record respondsToSelector:@selector(awakeFromDB)] )
+		[record awakeFromDB];
+
+	if ( identity )
+		@synchronized( identityMap ) {
+			[identityMap setObject:record forKey:identity];
+		}
+	return record;
+}
+
+/**
+ Bind the column values of a record for an insert reading scalar ivars directly.
+ */
+
+- (BOOL)bindRecord:(id)record metaData:(OOMetaData *)metaData startingAt:(int)pno {
+	if ( !metaData->plan )
+		return [self bindCols:metaData->columns values:[metaData encodeRecord:record] startingAt:pno bindNulls:YES];
+
+	int errcode;
+	for ( int p=0 ; p<metaData->nplan ; p++ ) {
+		const struct _ooIvarPlan &plan = metaData->plan[p];
+		if ( plan.rowid )
+			continue;
+
+		void *ivar = (char *)OO_BRIDGE(void *)record + plan.offset;
+		switch ( plan.getDirect ? plan.type : 0 ) {
+			case 'c': errcode = sqlite3_bind_int( stmt, pno, *(char *)ivar ); break;
+			case 'C': errcode = sqlite3_bind_int( stmt, pno, *(unsigned char *)ivar ); break;
+			case 's': errcode = sqlite3_bind_int( stmt, pno, *(short *)ivar ); break;
+			case 'S': errcode = sqlite3_bind_int( stmt, pno, *(unsigned short *)ivar ); break;
+			case 'i': case 'l': errcode = sqlite3_bind_int( stmt, pno, *(int *)ivar ); break;
+			case 'I': case 'L': errcode = sqlite3_bind_int64( stmt, pno, *(unsigned *)ivar ); break;
+			case 'q': case 'Q': errcode = sqlite3_bind_int64( stmt, pno, *(long long *)ivar ); break;
+			case 'f': errcode = sqlite3_bind_double( stmt, pno, *(float *)ivar ); break;
+			case 'd': errcode = sqlite3_bind_double( stmt, pno, *(double *)ivar ); break;
+			default:
+				errcode = [self bindValue:[metaData valueForPlan:p ofRecord:record] asParameter:pno];
+		}
+
+		if ( errcode != SQLITE_OK )
+			OOWarn( @"-[OOAdaptor bindRecord:...] Bind failed column: %s - %s (%d)", plan.name,
+				   owner->errmsg = (char *)sqlite3_errmsg( db ), owner->errcode = errcode );
+		pno++;
+	}
+	return owner->errcode == SQLITE_OK;
+}
+
+static long long ooParseLongLong( const char *field, size_t len ) {
+	const char *end = field + len;
+	long long value = 0;
+	BOOL negative = NO;
+
+	while ( field < end && *field == ' ' )
+		field++;
+	if ( field < end && (*field == '-' || *field == '+') )
+		negative = *field++ == '-';
+	while ( field < end && *field >= '0' && *field <= '9' )
+		value = value * 10 + *field++ - '0';
+
+	return negative ? -value : value;
+}
+
+static double ooParseDouble( const char *field, size_t len ) {
+	char buffer[64];
+	len = MIN( len, sizeof buffer - 1 );
+	memcpy( buffer, field, len );
+	buffer[len] = '\000';
+	return strtod( buffer, NULL );
+}
+
+static int ooHexValue( char ch ) {
+	return ch <= '9' ? ch - '0' : (ch | 0x20) - 'a' + 10;
+}
+
+/**
+ Bind one field of a line being imported as the type of the column it is for. Text is bound
+ in place unless it contains escaped newlines. Blobs are hex as written by export:.
+ */
+
+- (int)bindField:(const char *)field length:(size_t)len asParameter:(int)pno plan:(const struct _ooIvarPlan &)plan {
+	switch ( plan.type ) {
+		case 'c': case 's': case 'i': case 'l': case 'q':
+		case 'C': case 'S': case 'I': case 'L': case 'Q':
+			return sqlite3_bind_int64( stmt, pno, ooParseLongLong( field, len ) );
+		case 'f': case 'd':
+			return sqlite3_bind_double( stmt, pno, ooParseDouble( field, len ) );
+	}
+
+	if ( len == 0 )
+		return sqlite3_bind_null( stmt, pno );
+	if ( plan.date )
+		return sqlite3_bind_double( stmt, pno, ooParseDouble( field, len ) );
+
+	if ( plan.text ) {
+		if ( memchr( field, '\n', len ) ) {
+			char *copy = [self arenaAlloc:len], *optr = copy;
+			// the backslash escaping a newline is removed and the newline kept
+			for ( size_t i=0 ; i<len ; i++ )
+				if ( !(field[i] == '\\' && i+1 < len && field[i+1] == '\n') )
+					*optr++ = field[i];
+			field = copy;
+			len = optr - copy;
+		}
+		return sqlite3_bind_text( stmt, pno, field, (int)len, SQLITE_STATIC );
+	}
+
+	unsigned char *bytes = (unsigned char *)[self arenaAlloc:len/2+1], *optr = bytes;
+	int nibbles = 0, byte = 0;
+	for ( size_t i=0 ; i<len ; i++ )
+		if ( isxdigit( (unsigned char)field[i] ) ) {
+			byte = byte * 16 + ooHexValue( field[i] );
+			if ( ++nibbles % 2 == 0 ) {
+				*optr++ = (unsigned char)byte;
+				byte = 0;
+			}
+		}
+	return sqlite3_bind_blob( stmt, pno, bytes, (int)(optr-bytes), SQLITE_STATIC );
+}
+
+/**
+ Split a line being imported by the delimiter binding each field to the prepared insert.
+ Missing trailing fields are bound as if empty.
+ */
+
+- (BOOL)bindLine:(const char *)line length:(size_t)length delimiter:(const char *)delim metaData:(OOMetaData *)metaData {
+	const char *end = line + length, *field = line;
+	size_t seplen = strlen( delim );
+	int pno = 1, errcode;
+
+	for ( int p=0 ; p<metaData->nplan ; p++ ) {
+		const struct _ooIvarPlan &plan = metaData->plan[p];
+		if ( plan.rowid )
+			continue;
+
+		const char *next = end;
+		if ( field )
+			for ( const char *ptr = field ; ptr + seplen <= end ; ptr++ )
+				if ( *ptr == *delim && memcmp( ptr, delim, seplen ) == 0 ) {
+					next = ptr;
+					break;
+				}
+
+		if ( (errcode = [self bindField:field length:field ? next-field : 0 asParameter:pno++ plan:plan]) != SQLITE_OK ) {
+			OOWarn( @"-[OOAdaptor bindLine:...] Bind failed column: %s - %s (%d)", plan.name,
+				   owner->errmsg = (char *)sqlite3_errmsg( db ), owner->errcode = errcode );
+			return NO;
+		}
+
+		field = field && next < end ? next + seplen : NULL;
+	}
+
+	return YES;
+}
+
+/**
+ Execute a prepared insert for one row then reset it ready for the next.
+ */
+
+- (BOOL)stepRow {
+	int errcode = sqlite3_step( stmt );
+	if ( errcode != SQLITE_DONE )
+		OOWarn( @"-[OOAdaptor stepRow] Insert failed: %@ - %s", *owner->lastSQL,
+			   owner->errmsg = (char *)sqlite3_errmsg( db ) );
+	owner->errcode = errcode == SQLITE_DONE ? SQLITE_OK : errcode;
+	sqlite3_reset( stmt );
+	[self resetArena];
+	return errcode == SQLITE_DONE;
+}
+
+/**
+ Step a statement returning a single value such as an aggregate and read it as an integer
+ and/or a real without creating objects. Returns NO if there was no row or it was null.
+ */
+
+- (BOOL)stepAggregate:(sqlite3_int64 *)integer real:(double *)real {
+	int errcode = sqlite3_step( stmt );
+	BOOL found = errcode == SQLITE_ROW && sqlite3_column_type( stmt, 0 ) != SQLITE_NULL;
+
+	if ( found ) {
+		if ( integer )
+			*integer = sqlite3_column_int64( stmt, 0 );
+		if ( real )
+			*real = sqlite3_column_double( stmt, 0 );
+	}
+	else if ( errcode != SQLITE_ROW && errcode != SQLITE_DONE )
+		OOWarn( @"-[OOAdaptor stepAggregate:real:] Error stepping: %@ - %s", *owner->lastSQL,
+			   owner->errmsg = (char *)sqlite3_errmsg( db ) );
+
+	owner->errcode = errcode == SQLITE_ROW || errcode == SQLITE_DONE ? SQLITE_OK : errcode;
+	[self resetArena];
+	[self finishStatement];
+	return found;
+}
+
+/**
+ Take ownership of the current statement away from the adaptor so it can be stepped
+ independently of other statements, for example by a cursor.
+ */
+
+- (sqlite3_stmt *)detachStatement {
+	sqlite3_stmt *detached = stmt;
+	if ( stmtCached ) {
+		for ( NSString *key in [*stmtCache allKeysForObject:[NSValue valueWithPointer:stmt]] ) {
+			~stmtCache[key];
+			stmtLRU -= key;
+		}
+		stmtCached = NO;
+	}
+	stmt = NULL;
+	return detached;
+}
+
+/**
+ Create instances of the recordClass to store results from a database select or if the record
+ class is not present return a list of dictionary objects with the raw results.
+ */
+
+- (OOArray<id>)bindResultsIntoInstancesOfClass:(Class)recordClass metaData:(OOMetaData *)metaData {
+	OOArray<id> out;
+	int *map = NULL;
+
+	while( (owner->errcode = sqlite3_step( stmt )) == SQLITE_ROW ) {
+		if ( recordClass && !map )
+			map = [self newColumnMapForRow:stmt metaData:metaData];
+
+		id object = [self newObjectForRow:stmt ofClass:recordClass metaData:metaData columnMap:map];
+		out += object;
+		OO_RELEASE( object );
+	}
+
+	free( map );
+
+	if ( [self finishResults] )
+		out.alloc();
+	return out;
+}
+
+/**
+ Step the current statement into a column oriented result set.
+ */
+
+- (OOResultSet *)newResultSet {
+	OOResultSet *set = [[OOResultSet alloc] initStatement:stmt];
+	while( (owner->errcode = sqlite3_step( stmt )) == SQLITE_ROW )
+		[set addRow:stmt];
+	[self finishResults];
+	return set;
+}
+
+/**
+ Check the statement has stepped to completion then free any strings bound to it.
+ */
+
+- (BOOL)finishResults {
+	BOOL done = owner->errcode == SQLITE_DONE;
+	if ( !done )
+		OOWarn(@"-[OOAdaptor finishResults] Not done (bind) stmt: %@ - %s", *owner->lastSQL, owner->errmsg = (char *)sqlite3_errmsg( db ) );
+	else
+		owner->errcode = SQLITE_OK;
+
+	[self resetArena];
+	owner->updateCount = sqlite3_changes( db );
+	[self finishStatement];
+	return done;
+}
+
+- (sqlite_int64)lastInsertRowID {
+	return sqlite3_last_insert_rowid( db );
+}
+
+/**
+ Open the value of a column of a row for incremental I/O. Returns NULL if the row does
+ not exist or the value is null, which is not an error for a deferred column.
+ */
+
+- (sqlite3_blob *)openBlob:(cOOString)column table:(cOOString)table row:(sqlite3_int64)rowid writable:(BOOL)writable {
+	sqlite3_blob *blob = NULL;
+	if ( (owner->errcode = sqlite3_blob_open( db, "main", table, column, rowid, writable, &blob )) != SQLITE_OK ) {
+		owner->errmsg = (char *)sqlite3_errmsg( db );
+		sqlite3_blob_close( blob );
+		blob = NULL;
+	}
+	return blob;
+}
+
+- (BOOL)inTransaction {
+	return !sqlite3_get_autocommit( db );
+}
+
+- (int)totalChanges {
+	return sqlite3_total_changes( db );
+}
+
+- (void)setBusyTimeout:(int)ms {
+	sqlite3_busy_timeout( db, ms );
+}
+
+/**
+ Install or, passing nil, remove the sqlite trace callback timing statements.
+ */
+
+- (void)setProfile:(OOSqlProfile *)aProfile {
+	profile = aProfile;
+#if SQLITE_VERSION_NUMBER >= 3014000
+	sqlite3_trace_v2( db, aProfile ? SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW : 0,
+					 aProfile ? ooTraceCallback : NULL, OO_BRIDGE(void *)aProfile );
+#else
+	sqlite3_profile( db, aProfile ? ooProfileCallback : NULL, OO_BRIDGE(void *)aProfile );
+#endif
+}
+
+/**
+ Install or, passing nil, remove the hooks collecting the rows changed for a change feed.
+ */
+
+- (void)setChangeFeed:(OOChangeFeed *)aFeed {
+	void *context = OO_BRIDGE(void *)aFeed;
+	sqlite3_update_hook( db, aFeed ? ooUpdateHook : NULL, context );
+	sqlite3_commit_hook( db, aFeed ? ooCommitHook : NULL, context );
+	sqlite3_rollback_hook( db, aFeed ? ooRollbackHook : NULL, context );
+}
+
+/**
+ Run a statement creating or dropping a virtual table over an array of records having
+ registered the module for them with this connection if that has not been done.
+ */
+
+- (BOOL)execSql:(cOOString)sql withArrayTables:(NSMutableDictionary *)tables {
+	if ( !arrayModule ) {
+		if ( (owner->errcode = sqlite3_create_module( db, "ooarray", &ooArrayModule, OO_BRIDGE(void *)tables )) != SQLITE_OK ) {
+			OOWarn( @"-[OOAdaptor execSql:withArrayTables:] Could not register module - %s",
+				   owner->errmsg = (char *)sqlite3_errmsg( db ) );
+			return NO;
 		}
-		else 
-			values = newValues;
+		arrayModule = YES;
+	}
+
+	char *error = NULL;
+	if ( (owner->errcode = sqlite3_exec( db, sql, NULL, NULL, &error )) != SQLITE_OK ) {
+		OOWarn( @"-[OOAdaptor execSql:withArrayTables:] Error in %@ - %s", *sql, error );
+		sqlite3_free( error );
+		owner->errmsg = (char *)sqlite3_errmsg( db );
+		return NO;
+	}
+	return YES;
+}
 
-		OOString sql = isInsert ? 
-		OOFormat( @"insert into %@ (%@) values (", *metaData->tableName, *(metaData->columns/", ") ) :
-		OOFormat( isUpdate ? @"update %@ set" : @"delete from %@", *metaData->tableName );
+- (int)parameterLimit {
+	return sqlite3_limit( db, SQLITE_LIMIT_VARIABLE_NUMBER, -1 );
+}
 
-		int nchanged = changedCols;
-		if ( isUpdate && nchanged == 0 ) {
-			OOWarn( @"%s %@ (%@)", errmsg = (char *)"-[ODatabase commit:] Update of unchanged record", *object, *(lastSQL = sql) );
-			continue;
+- (void) dealloc {
+	for ( NSValue *cached in [*stmtCache allValues] )
+		sqlite3_finalize( (sqlite3_stmt *)[cached pointerValue] );
+	[self resetArena];
+	free( arena );
+	sqlite3_close( db );
+	OO_DEALLOC( super );
+}
+
+@end
+
+#pragma mark OOResultSet column oriented results of an ad-hoc select
+
+union _ooResultValue {
+	long long i;
+	double d;
+	struct { unsigned offset, length; } bytes;
+};
+
+struct _ooResultColumn {
+	unsigned char *types;
+	union _ooResultValue *values;
+};
+
+/**
+ Row of a result set bridged to an NSDictionary without copying its values.
+ */
+
+@interface OOResultRow : NSDictionary {
+	OOReference<OOResultSet *> set;
+	int row;
+}
+@end
+
+@implementation OOResultRow
+
+- initSet:(OOResultSet *)aSet row:(int)aRow {
+	if ( (self = [super init]) ) {
+		set = aSet;
+		row = aRow;
+	}
+	return self;
+}
+
+- (NSUInteger)count {
+	return set->ncols;
+}
+
+- (id)objectForKey:(id)key {
+	int col = [*set columnIndex:key];
+	return col < 0 ? nil : [*set valueForRow:row column:col];
+}
+
+- (NSEnumerator *)keyEnumerator {
+	return [*set->columnNames objectEnumerator];
+}
+
+@end
+
+@implementation OOResultSet
+
+- initStatement:(sqlite3_stmt *)stmt {
+	if ( (self = [super init]) ) {
+		ncols = sqlite3_column_count( stmt );
+		for ( int i=0 ; i<ncols ; i++ )
+			columnNames += sqlite3_column_name( stmt, i );
+		column = (struct _ooResultColumn *)calloc( ncols+1, sizeof *column );
+	}
+	return self;
+}
+
+/**
+ Copy the values of the current row of a statement into the columns.
+ */
+
+- (void)addRow:(sqlite3_stmt *)stmt {
+	if ( nrows == capacity ) {
+		capacity = capacity ? capacity * 2 : 16;
+		for ( int i=0 ; i<ncols ; i++ ) {
+			column[i].types = (unsigned char *)realloc( column[i].types, capacity * sizeof *column[i].types );
+			column[i].values = (union _ooResultValue *)realloc( column[i].values, capacity * sizeof *column[i].values );
 		}
+	}
 
-		for ( int i=0 ; i<nchanged ; i++ )
-			sql += OOFormat( @"%s\n\t%@ = ?", i==0 ? "" : ",", **changedCols[i] );
+	for ( int i=0 ; i<ncols ; i++ ) {
+		int type = column[i].types[nrows] = sqlite3_column_type( stmt, i );
+		union _ooResultValue &value = column[i].values[nrows];
+		const void *bytes = NULL;
 
-		if ( isInsert ) {
-			OOString quote = "?", commaQuote = ", ?";
-			for ( int i=0 ; i<metaData->columns ; i++ )
-				sql += i==0 ? quote : commaQuote;
-			sql += ")";
+		switch ( type ) {
+			case SQLITE_INTEGER:
+				value.i = sqlite3_column_int64( stmt, i );
+				continue;
+			case SQLITE_FLOAT:
+				value.d = sqlite3_column_double( stmt, i );
+				continue;
+			case SQLITE_TEXT:
+				bytes = sqlite3_column_text( stmt, i );
+				break;
+			case SQLITE_BLOB:
+				bytes = sqlite3_column_blob( stmt, i );
+				break;
+			default:
+				continue;
 		}
-		else
-			sql += [self whereClauseFor:metaData->columns values:values qualifyNulls:YES];
 
-#ifdef OODEBUG_SQL
-		NSLog( @"-[OODatabase commit]: %@ %@", *sql, *values );
-#endif
+		// text and blobs are appended to the arena nul terminated
+		unsigned length = sqlite3_column_bytes( stmt, i );
+		if ( arenaUsed + length + 1 > arenaSize ) {
+			arenaSize = MAX( arenaSize * 2, arenaUsed + length + 1 + 1024 );
+			arena = (char *)realloc( arena, arenaSize );
+		}
 
-		if ( ![*adaptor prepare:sql] )
-			continue;
+		memcpy( arena + arenaUsed, bytes, length );
+		arena[arenaUsed + length] = '\000';
+		value.bytes.offset = (unsigned)arenaUsed;
+		value.bytes.length = length;
+		arenaUsed += length + 1;
+	}
 
-		if ( isUpdate )
-			[*adaptor bindCols:changedCols values:newValues startingAt:1 bindNulls:YES];
-		[*adaptor bindCols:metaData->columns values:values startingAt:1+nchanged bindNulls:isInsert];
+	nrows++;
+}
 
-		[*adaptor bindResultsIntoInstancesOfClass:nil metaData:metaData];
-		commited += updateCount;
+- (NSUInteger)count {
+	return nrows;
+}
+
+- (id)objectAtIndex:(NSUInteger)row {
+	if ( row >= (NSUInteger)nrows )
+		[NSException raise:NSRangeException format:@"-[OOResultSet objectAtIndex:] Row %d beyond end of results (%d)", (int)row, nrows];
+	return OO_AUTORELEASE( [[OOResultRow alloc] initSet:self row:(int)row] );
+}
+
+- (NSArray *)objectForKeyedSubscript:(NSString *)name {
+	int col = [self columnIndex:name];
+	if ( col < 0 )
+		return nil;
+
+	OOArray<id> values;
+	values.alloc();
+	for ( int row=0 ; row<nrows ; row++ )
+		values += [self valueForRow:row column:col];
+	return &values;
+}
+
+- (int)columnIndex:(NSString *)name {
+	for ( int i=0 ; i<ncols ; i++ )
+		if ( [name isEqualToString:*columnNames[i]] )
+			return i;
+	return -1;
+}
+
+- (int)typeForRow:(int)row column:(int)col {
+	return column[col].types[row];
+}
+
+- (long long)longLongForRow:(int)row column:(int)col {
+	const union _ooResultValue &value = column[col].values[row];
+	switch ( column[col].types[row] ) {
+		case SQLITE_INTEGER: return value.i;
+		case SQLITE_FLOAT: return (long long)value.d;
+		case SQLITE_TEXT: return strtoll( arena + value.bytes.offset, NULL, 10 );
 	}
+	return 0;
+}
 
-	transaction = nil;
-	return commited;
+- (double)doubleForRow:(int)row column:(int)col {
+	const union _ooResultValue &value = column[col].values[row];
+	switch ( column[col].types[row] ) {
+		case SQLITE_INTEGER: return (double)value.i;
+		case SQLITE_FLOAT: return value.d;
+		case SQLITE_TEXT: return strtod( arena + value.bytes.offset, NULL );
+	}
+	return 0.;
+}
+
+- (NSString *)stringForRow:(int)row column:(int)col {
+	const union _ooResultValue &value = column[col].values[row];
+	switch ( column[col].types[row] ) {
+		case SQLITE_NULL:
+			return nil;
+		case SQLITE_TEXT:
+			return OO_AUTORELEASE( [[NSString alloc] initWithBytes:arena + value.bytes.offset
+															length:value.bytes.length encoding:NSUTF8StringEncoding] );
+	}
+	return [[self valueForRow:row column:col] stringValue];
 }
 
 /**
- Commit all pending inserts, updates, deletes to the database inside a transaction.
+ Value of a cell boxed as it would have been in the dictionaries previously returned.
  */
 
-- (int)commitTransaction {
-	[self exec:@"BEGIN TRANSACTION"];
-	int updated = [self commit];
-	return [self exec:@"COMMIT"] ? updated : 0;
+- (id)valueForRow:(int)row column:(int)col {
+	const union _ooResultValue &value = column[col].values[row];
+	switch ( column[col].types[row] ) {
+		case SQLITE_INTEGER:
+			return [NSNumber numberWithLongLong:value.i];
+		case SQLITE_FLOAT:
+			return [NSNumber numberWithDouble:value.d];
+		case SQLITE_TEXT:
+			return [self stringForRow:row column:col];
+		case SQLITE_BLOB:
+			return [NSData dataWithBytes:arena + value.bytes.offset length:value.bytes.length];
+	}
+	return OONull;
+}
+
+- (void)dealloc {
+	for ( int i=0 ; i<ncols ; i++ ) {
+		free( column[i].types );
+		free( column[i].values );
+	}
+	free( column );
+	free( arena );
+	OO_DEALLOC( super );
+}
+
+@end
+
+#pragma mark OORecordCursor steps through the results of a select a batch at a time
+
+@implementation OORecordCursor
+
+- initAdaptor:(OOAdaptor *)anAdaptor ofDatabase:(OODatabase *)aDatabase onWriter:(BOOL)isWriter
+	statement:(sqlite3_stmt *)aStmt intoClass:(Class)aClass metaData:(OOMetaData *)aMetaData {
+	if ( (self = [super init]) ) {
+		database = aDatabase;
+		adaptor = anAdaptor;
+		onWriter = isWriter;
+		stmt = aStmt;
+		recordClass = aClass;
+		metaData = aMetaData;
+		batchSize = OOSQL_CURSOR_BATCH;
+	}
+	return self;
 }
 
 /**
- Rollback any outstanding inserts, updates, or deletes. Please note updated values 
- are also rolled back inside the actual record in the application as well.
+ Step the statement for up to batchSize rows. Temporary objects created while
+ decoding the rows are released when the batch is complete.
  */
 
-- (int)rollback {
-	for ( NSMutableDictionary *d in *transaction ) {
-		OODictionary<id> values = d;
+- (void)fetchBatch {
+	batch = nil;
+	next = 0;
+
+	OODatabase *writerLock = onWriter ? database : nil;
+	if ( writerLock )
+		objc_sync_enter( writerLock );
+
+	@autoreleasepool {
+		for ( int n=0 ; stmt && n<batchSize ; n++ ) {
+			int errcode = sqlite3_step( stmt );
+			if ( errcode != SQLITE_ROW ) {
+				if ( errcode != SQLITE_DONE )
+					OOWarn( @"-[OORecordCursor fetchBatch] Error stepping stmt: %s - %s",
+						   sqlite3_sql( stmt ), sqlite3_errmsg( sqlite3_db_handle( stmt ) ) );
+				[self finish];
+				break;
+			}
 
-		if ( !!~values[kOOUpdate] ) {
-			OORef<OORecord *> record = ~values[kOOObject];
-			OOMetaData *metaData = [self tableMetaDataForClass:[*record class]];
+			if ( recordClass && !columnMap )
+				columnMap = [*adaptor newColumnMapForRow:stmt metaData:metaData];
 
-#ifndef OO_ARC
-			for ( NSString *name in *metaData->boxed )
-                OO_RELEASE( (id)[[*record valueForKey:name] pointerValue] );
-#endif
+			id object = [*adaptor newObjectForRow:stmt ofClass:recordClass
+										 metaData:metaData columnMap:columnMap];
+			batch += object;
+			OO_RELEASE( object );
+		}
+	}
 
-			[*record setValuesForKeysWithDictionary:[metaData decode:values]];
+	if ( writerLock )
+		objc_sync_exit( writerLock );
+}
+
+- (id)nextObject {
+	if ( next >= (int)batch )
+		[self fetchBatch];
+	return next < (int)batch ? *batch[next++] : nil;
+}
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state
+								  objects:(id OO_UNSAFE [])buffer count:(NSUInteger)len {
+	if ( next >= (int)batch )
+		[self fetchBatch];
+
+	NSUInteger count = 0;
+	while ( count < len && next < (int)batch )
+		buffer[count++] = *batch[next++];
+
+	state->state = 1;
+	state->itemsPtr = buffer;
+	state->mutationsPtr = &state->extra[0];
+	return count;
+}
+
+/**
+ Finalize the statement and return the connection it was stepped on to the reader pool.
+ */
+
+- (void)finish {
+	if ( stmt ) {
+		if ( onWriter ) {
+			@synchronized( database ) {
+				sqlite3_finalize( stmt );
+			}
 		}
+		else
+			sqlite3_finalize( stmt );
 	}
-	return (int)[*~transaction count];
+	stmt = NULL;
+	if ( database && !onWriter )
+		[database checkinReader:*adaptor];
+	database = nil;
 }
 
 /**
- Find/create an instance of the OOMetaData class which describes a record class and its associated table.
- If the table does not exist it will be created along with indexes for columns/ivars which have 
- upper case names for use in joins. Details of the tables parameters can be controlled by using
- methods in the OOTableCustomisation protool. If it does not exist a meta table class which
- prepresents OOMetaData records themselves is also created from which the list of all registered
- tables can be selected.
+ Finish with the statement before all rows have been read.
  */
- 
-- (OOMetaData *)tableMetaDataForClass:(Class)recordClass {
-	if ( !recordClass || recordClass == [OOMetaData class] )
-		return [OOMetaData metaDataForClass:[OOMetaData class]];
 
-	OOString className = class_getName( recordClass );
-	OOMetaData *metaData = tableMetaDataByClassName[className];
+- (void)close {
+	[self finish];
+	free( columnMap );
+	columnMap = NULL;
+	batch = nil;
+	next = 0;
+}
 
-	if ( !metaData ) {
-		metaData = [OOMetaData metaDataForClass:recordClass];
+- (void)dealloc {
+	[self close];
+	OO_DEALLOC( super );
+}
 
-#ifdef OODEBUG_SQL
-		NSLog(@"\n%@", *metaData->createTableSQL);
-#endif
+@end
 
-		if ( metaData->tableName[0] != '_' && 
-			[self stringForSql:@"select count(*) from sqlite_master where name = '%@'",
-             *metaData->tableName] == "0" )
-			if ( [self exec:@"%@", *metaData->createTableSQL] )
-				for ( NSString *idx in *metaData->indexes )
-					if ( ![self exec:idx] )
-						OOWarn( @"-[OOMetaData tableMetaDataForClass:] Error creating index: %@", idx );
+#pragma mark OOBlob reads and writes the value of a column incrementally
 
-		tableMetaDataByClassName[className] = metaData;
+@implementation OOBlob
+
+- initAdaptor:(OOAdaptor *)anAdaptor blob:(sqlite3_blob *)aBlob {
+	if ( (self = [super init]) ) {
+		adaptor = anAdaptor;
+		blob = aBlob;
 	}
+	return self;
+}
 
-	return metaData;
+- (int)length {
+	return blob ? sqlite3_blob_bytes( blob ) : 0;
 }
 
-@end
+- (NSData *)read:(int)length atOffset:(int)offset {
+	NSMutableData *data = [NSMutableData dataWithLength:length];
+	int errcode = blob ? sqlite3_blob_read( blob, [data mutableBytes], length, offset ) : SQLITE_MISUSE;
+	if ( errcode != SQLITE_OK ) {
+		OOWarn( @"-[OOBlob read:atOffset:] Error reading %d bytes at %d - %s", length, offset, sqlite3_errstr( errcode ) );
+		return nil;
+	}
+	return data;
+}
 
-#pragma mark OOAdaptor - implements all access to a particular database 
+- (BOOL)write:(NSData *)data atOffset:(int)offset {
+	int errcode = blob ? sqlite3_blob_write( blob, [data bytes], (int)[data length], offset ) : SQLITE_MISUSE;
+	if ( errcode != SQLITE_OK ) {
+		OOWarn( @"-[OOBlob write:atOffset:] Error writing %d bytes at %d - %s", (int)[data length], offset, sqlite3_errstr( errcode ) );
+		return NO;
+	}
 
-@implementation OOAdaptor 
+	// a record cached by the identity map would still have the old value
+	NSMapTable *identityMap = adaptor->identityMap;
+	if ( identityMap )
+		@synchronized( identityMap ) {
+			[identityMap removeAllObjects];
+		}
+	return YES;
+}
+
+- (void)close {
+	if ( blob )
+		sqlite3_blob_close( blob );
+	blob = NULL;
+	adaptor = nil;
+}
+
+- (void)dealloc {
+	[self close];
+	OO_DEALLOC( super );
+}
+
+@end
 
 /**
- Connect to/create sqlite3 database
+ Buffered writer used to export records to a file descriptor in fixed size blocks.
+ Numbers are formatted into the buffer directly without creating objects.
  */
 
-- (OOAdaptor *)initPath:(cOOString)path database:(OODatabase *)database {
-    if ( self = [super init] ) {
-        owner = database;
-        OOFile( OOFile( path ).dir() ).mkdir();
-        if ( (owner->errcode = sqlite3_open( path, &db )) != SQLITE_OK ) {
-            OOWarn( @"-[OOAdaptor initPath:database:] Error opening database at path: %@", *path );
-            return nil;
-        }
-    }
-	return self;
+class OOExportWriter {
+	int fd;
+	size_t used;
+	BOOL failed;
+	char buffer[OOSQL_EXPORT_BUFFER];
+public:
+	oo_inline OOExportWriter( int fd ) { this->fd = fd; used = 0; failed = fd < 0; }
+	oo_inline ~OOExportWriter() { flush(); if ( fd >= 0 ) close( fd ); }
+
+	oo_inline BOOL ok() { return !failed; }
+	void flush() {
+		for ( size_t done = 0 ; done < used && !failed ; ) {
+			ssize_t wrote = write( fd, buffer + done, used - done );
+			if ( wrote < 0 && errno != EINTR ) {
+				OOWarn( @"OOExportWriter::flush() Write failed: %s", strerror( errno ) );
+				failed = YES;
+			}
+			else if ( wrote > 0 )
+				done += wrote;
+		}
+		used = 0;
+	}
+	oo_inline void put( char ch ) {
+		if ( used == sizeof buffer )
+			flush();
+		buffer[used++] = ch;
+	}
+	void put( const char *bytes, size_t len ) {
+		while ( len ) {
+			if ( used == sizeof buffer )
+				flush();
+			size_t n = MIN( len, sizeof buffer - used );
+			memcpy( buffer + used, bytes, n );
+			used += n;
+			bytes += n;
+			len -= n;
+		}
+	}
+	void put( unsigned long long value, BOOL negative = NO ) {
+		char digits[24], *ptr = digits + sizeof digits;
+		do
+			*--ptr = '0' + value % 10;
+		while ( (value /= 10) );
+		if ( negative )
+			*--ptr = '-';
+		put( ptr, digits + sizeof digits - ptr );
+	}
+	oo_inline void put( long long value ) {
+		put( value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value, value < 0 );
+	}
+	void put( double value, int precision ) {
+		char digits[40];
+		put( digits, snprintf( digits, sizeof digits, "%.*g", precision, value ) );
+	}
+	void putText( const char *bytes, size_t len ) {
+		// newlines in text are escaped with a backslash which the importers remove
+		for ( const char *nl ; len && (nl = (const char *)memchr( bytes, '\n', len )) ; ) {
+			put( bytes, nl - bytes );
+			put( "\\\n", 2 );
+			len -= nl + 1 - bytes;
+			bytes = nl + 1;
+		}
+		put( bytes, len );
+	}
+	void putString( NSString *string ) {
+		const char *utf8 = CFStringGetCStringPtr( OO_BRIDGE(CFStringRef)string, kCFStringEncodingUTF8 );
+		if ( utf8 ) {
+			putText( utf8, strlen( utf8 ) );
+			return;
+		}
+
+		NSRange remaining = NSMakeRange( 0, [string length] );
+		char chunk[4096];
+		while ( remaining.length ) {
+			NSUInteger len = 0;
+			if ( ![string getBytes:chunk maxLength:sizeof chunk usedLength:&len encoding:NSUTF8StringEncoding
+						   options:0 range:remaining remainingRange:&remaining] || !len )
+				break;
+			putText( chunk, len );
+		}
+	}
+	void putHex( NSData *data ) {
+		static const char hex[] = "0123456789abcdef";
+		const unsigned char *bytes = (const unsigned char *)[data bytes];
+		for ( NSUInteger i=0, len = [data length] ; i<len ; i++ ) {
+			put( hex[bytes[i] >> 4] );
+			put( hex[bytes[i] & 0xf] );
+		}
+	}
+	void putObject( id value ) {
+		if ( !value || value == OONull )
+			return;
+		if ( [value isKindOfClass:[NSString class]] )
+			putString( value );
+		else if ( [value isKindOfClass:[NSData class]] )
+			putHex( value );
+		else if ( [value isKindOfClass:[NSNumber class]] )
+			switch ( *[value objCType] ) {
+				case 'f': put( [value doubleValue], 7 ); break;
+				case 'd': put( [value doubleValue], 16 ); break;
+				case 'Q': put( [value unsignedLongLongValue] ); break;
+				default: put( [value longLongValue] );
+			}
+		else
+			putString( [value stringValue] );
+	}
+};
+
+#pragma mark OOBinaryCodec compact encoding of archived ivars
+
+static const char kOOCodecMagic[] = "OOC", kOOCodecVersion = 1;
+
+static void ooPutVarint( NSMutableData *out, unsigned long long value ) {
+	unsigned char bytes[10], *ptr = bytes;
+	do {
+		*ptr = value & 0x7f;
+		if ( (value >>= 7) )
+			*ptr |= 0x80;
+		ptr++;
+	} while ( value );
+	[out appendBytes:bytes length:ptr-bytes];
+}
+
+static void ooPutTag( NSMutableData *out, char tag ) {
+	[out appendBytes:&tag length:1];
+}
+
+static void ooPutDouble( NSMutableData *out, double value ) {
+	CFSwappedFloat64 swapped = CFConvertDoubleHostToSwapped( value );
+	[out appendBytes:&swapped length:sizeof swapped];
+}
+
+static void ooPutBytes( NSMutableData *out, const void *bytes, NSUInteger length ) {
+	ooPutVarint( out, length );
+	[out appendBytes:bytes length:length];
 }
 
 /**
- Prepare a sql statement after which values can be bound and results returned.
+ Reader for decoding which checks every read is within the data.
  */
 
-- (BOOL)prepare:(cOOString)sql {
-	if ( (owner->errcode = sqlite3_prepare_v2( db, owner->lastSQL = sql, -1, &stmt, 0 )) != SQLITE_OK )
-		OOWarn(@"-[OOAdaptor prepare:] Could not prepare sql: \"%@\" - %s", *owner->lastSQL, owner->errmsg = (char *)sqlite3_errmsg( db ) );
-	return owner->errcode == SQLITE_OK;
+struct _ooCodecReader {
+	const unsigned char *ptr, *end;
+	BOOL failed;
+
+	BOOL has( size_t n ) {
+		return !(failed |= (size_t)(end - ptr) < n);
+	}
+	unsigned long long varint() {
+		unsigned long long value = 0;
+		for ( int shift=0 ; shift<64 && has( 1 ) ; shift += 7 ) {
+			value |= (unsigned long long)(*ptr & 0x7f) << shift;
+			if ( !(*ptr++ & 0x80) )
+				return value;
+		}
+		failed = YES;
+		return 0;
+	}
+	double real() {
+		CFSwappedFloat64 swapped = {0};
+		if ( has( sizeof swapped ) ) {
+			memcpy( &swapped, ptr, sizeof swapped );
+			ptr += sizeof swapped;
+		}
+		return CFConvertDoubleSwappedToHost( swapped );
+	}
+	const void *bytes( NSUInteger &length ) {
+		length = (NSUInteger)varint();
+		const void *bytes = ptr;
+		if ( !has( length ) )
+			return NULL;
+		ptr += length;
+		return bytes;
+	}
+};
+
+@implementation OOBinaryCodec
+
++ (OOBinaryCodec *)sharedInstance {
+	static OOBinaryCodec *shared;
+	static dispatch_once_t once;
+	dispatch_once( &once, ^{
+		shared = [[OOBinaryCodec alloc] init];
+	} );
+	return shared;
 }
 
-- (int)bindValue:(id)value asParameter:(int)pno {
-#ifdef OODEBUG_BIND
-	NSLog( @"-[OOAdaptor bindValue:bindValue:] bind parameter #%d as: %@", pno, value );
-#endif
+- (void)encode:(id)value into:(NSMutableData *)out {
 	if ( !value || value == OONull )
-		return sqlite3_bind_null( stmt, pno );
-//#define OOSQL_THREAD_SAFE_BUT_USES_MORE_MEMORY
-#ifdef OOSQL_THREAD_SAFE_BUT_USES_MORE_MEMORY
-	else if ( [value isKindOfClass:[NSString class]] )
-		return sqlite3_bind_text( stmt, pno, [value UTF8String], -1, SQLITE_STATIC );
-#else
+		ooPutTag( out, '0' );
 	else if ( [value isKindOfClass:[NSString class]] ) {
-		int len = (int)[value lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
-		struct _str_link *str = (struct _str_link *)malloc( sizeof *str->next + len + 1 );
-		str->next = strs;
-		strs = str;
-		[value getCString:str->str maxLength:len+1 encoding:NSUTF8StringEncoding];
-		return sqlite3_bind_text( stmt, pno, str->str, len, SQLITE_STATIC );
+		NSData *utf8 = [value dataUsingEncoding:NSUTF8StringEncoding];
+		ooPutTag( out, 's' );
+		ooPutBytes( out, [utf8 bytes], [utf8 length] );
 	}
-#endif
-	else if ( [value isKindOfClass:[NSData class]] )
-		return sqlite3_bind_blob( stmt, pno, [value bytes], (int)[value length], SQLITE_STATIC );
-
-	const char *type = [value objCType];
-	if ( type )
-		switch ( type[0] ) {
-			case 'c': case 's': case 'i': case 'l':
-			case 'C': case 'S': case 'I': case 'L':
-				return sqlite3_bind_int( stmt, pno, [value intValue] );
-			case 'q': case 'Q':
-				return sqlite3_bind_int64( stmt, pno, [value longLongValue] );
-			case 'f': case 'd':
-				return sqlite3_bind_double( stmt, pno, [value doubleValue] );
+	else if ( [value isKindOfClass:[NSNumber class]] && ![value isKindOfClass:[NSDecimalNumber class]] ) {
+		const char type = *[value objCType];
+		if ( CFGetTypeID( OO_BRIDGE(CFTypeRef)value ) == CFBooleanGetTypeID() ) {
+			ooPutTag( out, 'B' );
+			ooPutVarint( out, [value boolValue] );
 		}
-
-	OOWarn( @"-[OOAdaptor bindValue:bindValue:] Undefined type in bind of parameter #%d: %s, value: %@", pno, type, value );
-	return -1;
+		else if ( type == 'f' || type == 'd' ) {
+			ooPutTag( out, 'd' );
+			ooPutDouble( out, [value doubleValue] );
+		}
+		else if ( type == 'Q' ) {
+			ooPutTag( out, 'u' );
+			ooPutVarint( out, [value unsignedLongLongValue] );
+		}
+		else {
+			long long integer = [value longLongValue];
+			ooPutTag( out, 'i' );
+			ooPutVarint( out, ((unsigned long long)integer << 1) ^ (unsigned long long)(integer >> 63) );
+		}
+	}
+	else if ( [value isKindOfClass:[NSData class]] ) {
+		ooPutTag( out, 'b' );
+		ooPutBytes( out, [value bytes], [value length] );
+	}
+	else if ( [value isKindOfClass:[NSDate class]] ) {
+		ooPutTag( out, 't' );
+		ooPutDouble( out, [value timeIntervalSince1970] );
+	}
+	else if ( [value isKindOfClass:[NSArray class]] ) {
+		ooPutTag( out, 'a' );
+		ooPutVarint( out, [value count] );
+		for ( id element in value )
+			[self encode:element into:out];
+	}
+	else if ( [value isKindOfClass:[NSDictionary class]] ) {
+		ooPutTag( out, 'h' );
+		ooPutVarint( out, [value count] );
+		for ( id key in value ) {
+			[self encode:key into:out];
+			[self encode:[value objectForKey:key] into:out];
+		}
+	}
+	else {
+		// not a property list value
+		NSData *archive = [NSKeyedArchiver archivedDataWithRootObject:value];
+		ooPutTag( out, 'k' );
+		ooPutBytes( out, [archive bytes], [archive length] );
+	}
 }
 
-/**
- Bind parameters from a prepared SQL statement. The "objCType" method is used to determine the type to bind.
- */
-
-- (BOOL)bindCols:(cOOStringArray)columns values:(cOOValueDictionary)values startingAt:(int)pno bindNulls:(BOOL)bindNulls {
-	int errcode;
-	for ( NSString *name in *columns )
-		if ( bindNulls || *values[name] != OONull )
-			if ( (errcode = [self bindValue:values[name] asParameter:pno++]) != SQLITE_OK )
-				OOWarn( @"-[OOAdaptor bindCols:...] Bind failed column: %@ - %s (%d)", name, owner->errmsg = (char *)sqlite3_errmsg( db ), owner->errcode = errcode );
-	return owner->errcode == SQLITE_OK;
+- (NSData *)encodeColumnValue:(id)value {
+	NSMutableData *out = [NSMutableData dataWithBytes:kOOCodecMagic length:sizeof kOOCodecMagic-1];
+	ooPutTag( out, kOOCodecVersion );
+	[self encode:value into:out];
+	return out;
 }
 
-/**
- Return a dictionary containing the values for a row returned by the database from a select.
- These values need to be decoded using a classes metadata to set the ivar values later.
- */
+- (id)decode:(struct _ooCodecReader &)in OO_RETURNS {
+	NSUInteger length;
+	const void *bytes;
+	id value = nil;
 
-- (OOValueDictionary)valuesForNextRow {
-	int ncols = sqlite3_column_count( stmt );
-	OOValueDictionary values;
-
-	for ( int i=0 ; i<ncols ; i++ ) {
-		OOString name = sqlite3_column_name( stmt, i );
-		id value = nil;
+	if ( !in.has( 1 ) )
+		return nil;
 
-		switch ( sqlite3_column_type( stmt, i ) ) {
-			case SQLITE_NULL:
-				value = OONull;
-				break;
-			case SQLITE_INTEGER:
-				value = [[NSNumber alloc] initWithLongLong:sqlite3_column_int64( stmt, i )]; 
-				break;
-			case SQLITE_FLOAT:
-				value = [[NSNumber alloc] initWithDouble:sqlite3_column_double( stmt, i )]; 
-				break;
-			case SQLITE_TEXT: {
-				const unsigned char *bytes = sqlite3_column_text( stmt, i );
-				value = [[NSMutableString alloc] initWithBytes:bytes
-														length:sqlite3_column_bytes( stmt, i) 
-													  encoding:NSUTF8StringEncoding];
+	switch ( *in.ptr++ ) {
+		case '0':
+			return OO_RETAIN( OONull );
+		case 'B':
+			return OO_RETAIN( [NSNumber numberWithBool:in.varint() != 0] );
+		case 'i': {
+			unsigned long long zigzag = in.varint();
+			return [[NSNumber alloc] initWithLongLong:(long long)(zigzag >> 1) ^ -(long long)(zigzag & 1)];
+		}
+		case 'u':
+			return [[NSNumber alloc] initWithUnsignedLongLong:in.varint()];
+		case 'd':
+			return [[NSNumber alloc] initWithDouble:in.real()];
+		case 't':
+			return [[NSDate alloc] initWithTimeIntervalSince1970:in.real()];
+		case 's':
+			if ( (bytes = in.bytes( length )) )
+				value = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+			return value;
+		case 'b':
+			if ( (bytes = in.bytes( length )) )
+				value = [[NSData alloc] initWithBytes:bytes length:length];
+			return value;
+		case 'k':
+			if ( (bytes = in.bytes( length )) )
+				value = OO_RETAIN( [NSKeyedUnarchiver unarchiveObjectWithData:[NSData dataWithBytesNoCopy:(void *)bytes
+																							   length:length freeWhenDone:NO]] );
+			return value;
+		case 'a': {
+			NSUInteger count = (NSUInteger)in.varint();
+			NSMutableArray *array = [[NSMutableArray alloc] initWithCapacity:MIN( count, 1024 )];
+			for ( NSUInteger i=0 ; i<count && !in.failed ; i++ ) {
+				id element = [self decode:in];
+				if ( element )
+					[array addObject:element];
+				OO_RELEASE( element );
 			}
-				break;
-			case SQLITE_BLOB: {
-				const void *bytes = sqlite3_column_blob( stmt, i );
-				value = [[NSData alloc] initWithBytes:bytes length:sqlite3_column_bytes( stmt, i )];
+			return array;
+		}
+		case 'h': {
+			NSUInteger count = (NSUInteger)in.varint();
+			NSMutableDictionary *dict = [[NSMutableDictionary alloc] initWithCapacity:MIN( count, 1024 )];
+			for ( NSUInteger i=0 ; i<count && !in.failed ; i++ ) {
+				id key = [self decode:in], element = [self decode:in];
+				if ( key && element )
+					[dict setObject:element forKey:key];
+				OO_RELEASE( key );
+				OO_RELEASE( element );
 			}
-				break;
-			default:
-				OOWarn( @"-[OOAdaptor valuesForNextRow:] Invalid type on bind of ivar %@: %d", *name, sqlite3_column_type( stmt, i ) );
+			return dict;
 		}
-
-		values[name] = value;
-		OO_RELEASE( value );
 	}
 
-	return values;
+	in.failed = YES;
+	return nil;
 }
 
-/**
- Create instances of the recordClass to store results from a database select or if the record
- class is not present return a list of dictionary objects with the raw results.
- */
-
-- (OOArray<id>)bindResultsIntoInstancesOfClass:(Class)recordClass metaData:(OOMetaData *)metaData {
-	OOArray<id> out;
-	BOOL awakeFromDB = [recordClass instancesRespondToSelector:@selector(awakeFromDB)];
-
-	while( (owner->errcode = sqlite3_step( stmt )) == SQLITE_ROW ) {
-		OOValueDictionary values = [self valuesForNextRow];
-		if ( recordClass ) {
-			id record = [[recordClass alloc] init];
-			[record setValuesForKeysWithDictionary:[metaData decode:values]];
-
-			if ( awakeFromDB )
-				[record awakeFromDB];
+- (id)decodeColumnData:(NSData *)data {
+	const unsigned char *bytes = (const unsigned char *)[data bytes];
+	NSUInteger length = [data length], header = sizeof kOOCodecMagic;
 
-			out += record;
-			OO_RELEASE( record );
-		}
-		else
-			out += values;
-	}
+	// values stored before this codec existed are keyed archives
+	if ( length < header || memcmp( bytes, kOOCodecMagic, header-1 ) != 0 )
+		return [NSKeyedUnarchiver unarchiveObjectWithData:data];
 
-	if ( owner->errcode != SQLITE_DONE )
-		OOWarn(@"-[OOAdaptor bindResultsIntoInstancesOfClass:metaData:] Not done (bind) stmt: %@ - %s", *owner->lastSQL, owner->errmsg = (char *)sqlite3_errmsg( db ) );
-	else {
-		owner->errcode = SQLITE_OK;
-		out.alloc();
+	if ( bytes[header-1] != kOOCodecVersion ) {
+		OOWarn( @"-[OOBinaryCodec decodeColumnData:] Unknown version %d", bytes[header-1] );
+		return nil;
 	}
 
-	while ( strs != NULL ) {
-		struct _str_link *next = strs->next;
-		free( strs );
-		strs = next;
+	struct _ooCodecReader in = { bytes + header, bytes + length, NO };
+	id value = OO_AUTORELEASE( [self decode:in] );
+	if ( in.failed ) {
+		OOWarn( @"-[OOBinaryCodec decodeColumnData:] Invalid data of length %d", (int)length );
+		return nil;
 	}
-	owner->updateCount = sqlite3_changes( db );
-	sqlite3_finalize( stmt );
-	return out;
+	return value;
 }
 
-- (sqlite_int64)lastInsertRowID {
-	return sqlite3_last_insert_rowid( db );
+@end
+
+@implementation OOKeyedArchiveCodec
+
+- (NSData *)encodeColumnValue:(id)value {
+	return [NSKeyedArchiver archivedDataWithRootObject:value];
 }
 
-- (void) dealloc {
-	sqlite3_close( db );
-	OO_DEALLOC( super );
+- (id)decodeColumnData:(NSData *)data {
+	return [NSKeyedUnarchiver unarchiveObjectWithData:data];
 }
 
 @end
@@ -903,17 +4806,20 @@ static OOReference<OODatabase *> sharedInstance;
 @implementation OOMetaData
 
 static OODictionary<OOMetaData *> metaDataByClass;
+static OODictionary<NSMutableSet *> classNamesByColumn;
 static OOMetaData *tableOfTables;
 
 + (NSString *)ooTableTitle { return @"Table MetaData"; }
 
 + (OOMetaData *)metaDataForClass:(Class)recordClass OO_RETURNS {
-	if ( !tableOfTables )
-		OO_RELEASE( tableOfTables = [[OOMetaData alloc] initClass:[OOMetaData class]] );
-	OOMetaData *metaData = metaDataByClass[recordClass];
-	if ( !metaData )
-		OO_RELEASE( metaData = [[OOMetaData alloc] initClass:recordClass] );
-	return metaData;
+	@synchronized( self ) {
+		if ( !tableOfTables )
+			OO_RELEASE( tableOfTables = [[OOMetaData alloc] initClass:[OOMetaData class]] );
+		OOMetaData *metaData = metaDataByClass[recordClass];
+		if ( !metaData )
+			OO_RELEASE( metaData = [[OOMetaData alloc] initClass:recordClass] );
+		return metaData;
+	}
 }
 
 + (OOArray<id>)selectRecordsRelatedTo:(id)record {
@@ -1003,11 +4909,22 @@ static OOMetaData *tableOfTables;
 			if ( columnName == @"rowid" || columnName == @"ROWID" ||
                 columnName == @"OID" || columnName == @"_ROWID_" ) {
 				outcols += columnName;
+				rowidColumn = columnName;
+				[self planIvar:ivarInfo[in] column:columnName];
 				continue;
 			}
 
-			createTableSQL += OOFormat(@"%s\n\t%@ %@ /* %@ */",
-                                       !columns?"":",", *columnName, *dbtype, *type );
+			// the codec of archived columns is recorded in the schema
+			const char *codecName = "";
+			if ( [*archived containsObject:*columnName] ) {
+				id codec = [recordClass respondsToSelector:@selector(ooColumnCodecs)] ?
+					[[recordClass ooColumnCodecs] objectForKey:*columnName] : nil;
+				codecs[columnName] = codec = codec ? codec : [OOBinaryCodec sharedInstance];
+				codecName = class_getName( [codec class] );
+			}
+
+			createTableSQL += OOFormat(@"%s\n\t%@ %@ /* %@%s%s */",
+                                       !columns?"":",", *columnName, *dbtype, *type, *codecName ? " " : "", codecName );
 
 			if ( iswupper( columnName[columnName[0] != '_' ? 0 : 1] ) )
 				indexes += OOFormat(@"create index %@_%@ on %@ (%@)\n",
@@ -1018,15 +4935,25 @@ static OOMetaData *tableOfTables;
                 columns += columnName;
                 outcols += columnName;
                 joinableColumns += columnName;
+                [self planIvar:ivarInfo[in] column:columnName];
             }
         }
 
         free( ivarInfo );
     }
 
-	if ( [recordClass respondsToSelector:@selector(ooTableKey)] )
+	if ( [recordClass respondsToSelector:@selector(ooTableKey)] ) {
 		createTableSQL += OOFormat( @",\n\tprimary key (%@)",
                                    *(keyColumns = [recordClass ooTableKey]) );
+		keys = keyColumns["\\w+"];
+		if ( (keys & columns) != keys ) {
+			OOWarn( @"-[OOMetaData initClass:] Key columns %@ of class %@ are not all columns", *keyColumns, *recordClassName );
+			keys = nil;
+		}
+
+		for ( int p=0 ; p<nplan ; p++ )
+			plan[p].key = [*keys containsObject:[NSString stringWithUTF8String:plan[p].name]];
+	}
 
 	if ( [recordClass respondsToSelector:@selector(ooConstraints)] )
 		createTableSQL += OOFormat( @",\n\t%@", [recordClass ooConstraints] );
@@ -1038,36 +4965,234 @@ static OOMetaData *tableOfTables;
 		indexes = nil;
 	}
 
+	if ( [recordClass respondsToSelector:@selector(ooFullTextColumns)] ) {
+		fullTextColumns = OOString( [recordClass ooFullTextColumns] )["\\w+"];
+		if ( (fullTextColumns & tocopy) != fullTextColumns ) {
+			OOWarn( @"-[OOMetaData initClass:] Full text columns %@ of class %@ are not all string columns",
+				   [recordClass ooFullTextColumns], *recordClassName );
+			fullTextColumns = nil;
+		}
+	}
+
+	if ( [recordClass respondsToSelector:@selector(ooTracksChanges)] && [recordClass ooTracksChanges] )
+		[self addTrackingSetters];
+
+	if ( [recordClass respondsToSelector:@selector(ooDeferredColumns)] )
+		[self addDeferredGetters:OOString( [recordClass ooDeferredColumns] )["\\w+"]];
+
+	// external content FTS5 index kept up to date by triggers on the table
+	if ( !!fullTextColumns ) {
+		fullTextTable = tableName + "_fts";
+		OOString cols = fullTextColumns/", ",
+			newCols = "new." + (fullTextColumns/", new."), oldCols = "old." + (fullTextColumns/", old."),
+			insert = OOFormat( @"insert into %@ (rowid, %@) values (new.rowid, %@);",
+							  *fullTextTable, *cols, *newCols ),
+			remove = OOFormat( @"insert into %@ (%@, rowid, %@) values ('delete', old.rowid, %@);",
+							  *fullTextTable, *fullTextTable, *cols, *oldCols );
+
+		fullTextSQL += OOFormat( @"create virtual table %@ using fts5(%@, content='%@', content_rowid='rowid')",
+								*fullTextTable, *cols, *tableName );
+		fullTextSQL += OOFormat( @"create trigger %@_ai after insert on %@ begin\n\t%@\nend",
+								*fullTextTable, *tableName, *insert );
+		fullTextSQL += OOFormat( @"create trigger %@_ad after delete on %@ begin\n\t%@\nend",
+								*fullTextTable, *tableName, *remove );
+		fullTextSQL += OOFormat( @"create trigger %@_au after update on %@ begin\n\t%@\n\t%@\nend",
+								*fullTextTable, *tableName, *remove, *insert );
+	}
+
 	tableOfTables->tablesWithNaturalJoin += recordClassName;
 	tablesWithNaturalJoin += recordClassName;
 
-	for( Class other in [*metaDataByClass allKeys] ) {
-		OOMetaData *otherMetaData = metaDataByClass[other];
-		if ( other == recordClass || otherMetaData == tableOfTables )
-			continue;
+	if ( recordClass == [OOMetaData class] )
+		return self;
 
-		if ( [self naturalJoinTo:otherMetaData->joinableColumns] > 0 )
-			tablesWithNaturalJoin += otherMetaData->recordClassName;
-		if ( [otherMetaData naturalJoinTo:joinableColumns] > 0 )
-			otherMetaData->tablesWithNaturalJoin += recordClassName;
+	// find the classes sharing a joinable column using an index of
+	// the classes having each column rather than comparing every class
+	NSMutableSet *related = [NSMutableSet set];
+	for ( NSString *column in *joinableColumns )
+		if ( !islower( [column characterAtIndex:0] ) ) {
+			NSMutableSet *classes = *classNamesByColumn[column];
+			if ( !classes )
+				classNamesByColumn[column] = classes = [NSMutableSet set];
+			[related unionSet:classes];
+			[classes addObject:*recordClassName];
+		}
+
+	[related removeObject:*recordClassName];
+	for ( NSString *other in related ) {
+		OOMetaData *otherMetaData = metaDataByClass[NSClassFromString( other )];
+		tablesWithNaturalJoin += other;
+		otherMetaData->tablesWithNaturalJoin += recordClassName;
 	}
 
 	return self;
 }
 
+static BOOL ooHasAccessor( Class recordClass, cOOString key, BOOL setter ) {
+	OOString Key = [[[*key substringToIndex:1] uppercaseString] stringByAppendingString:[*key substringFromIndex:1]];
+	OOStringArray accessors = setter ?
+		OOFormat( @"set%@: _set%@:", *Key, *Key ) / " " :
+		OOFormat( @"%@ get%@ is%@ _%@", *key, *Key, *Key, *key ) / " ";
+	for ( NSString *accessor in *accessors )
+		if ( [recordClass instancesRespondToSelector:NSSelectorFromString( accessor )] )
+			return YES;
+	return NO;
+}
+
+/**
+ Add the plan for an output column so its ivar can be accessed directly when the class
+ does not provide an accessor key value coding would otherwise call.
+ */
+
+- (void)planIvar:(Ivar)ivar column:(cOOString)columnName {
+	plan = (struct _ooIvarPlan *)realloc( plan, (nplan+1) * sizeof *plan );
+	struct _ooIvarPlan &entry = plan[nplan++];
+	memset( &entry, 0, sizeof entry );
+
+	entry.name = ivar_getName( ivar );
+	entry.offset = ivar_getOffset( ivar );
+	entry.type = ivar_getTypeEncoding( ivar )[0];
+	entry.rowid = columnName == rowidColumn;
+	entry.text = [*tocopy containsObject:*columnName];
+	entry.date = [*dates containsObject:*columnName];
+	entry.archived = [*archived containsObject:*columnName];
+	entry.boxed = [*boxed containsObject:*columnName];
+	entry.unbox = [*unbox containsObject:*columnName];
+	entry.codec = *codecs[columnName];
+
+	if ( !strchr( "cCsSiIlLqQfd@{", entry.type ) || ![recordClass accessInstanceVariablesDirectly] )
+		return;
+
+	entry.setDirect = !ooHasAccessor( recordClass, columnName, YES );
+	entry.getDirect = !ooHasAccessor( recordClass, columnName, NO );
+}
+
+/**
+ Give a class with +ooTracksChanges a setter for each column of scalar or object type
+ that doesn't have one which records the column changed when it sets the ivar so commit
+ updates only those columns. Direct assignments to these ivars are found by comparing them
+ with the copy update: takes. Columns with their own setter or of other types are left in
+ "untracked" and compared with their encoded values as before.
+ */
+
+#define OO_TRACKING_SETTER( _type ) imp_implementationWithBlock( ^( id record, _type value ) { \
+	*(_type *)((char *)OO_BRIDGE(void *)record + offset) = value; \
+	ooMarkChanged( record, p ); \
+} )
+
+- (void)addTrackingSetters {
+	tracksChanges = YES;
+	untracked += *columns;
+
+	for ( int p=0 ; p<nplan ; p++ ) {
+		OOString column = plan[p].name;
+		if ( plan[p].rowid || ooHasAccessor( recordClass, column, YES ) )
+			continue;
+
+		ptrdiff_t offset = plan[p].offset;
+		IMP setter;
+		switch ( plan[p].type ) {
+			case 'c': setter = OO_TRACKING_SETTER( char ); break;
+			case 'C': setter = OO_TRACKING_SETTER( unsigned char ); break;
+			case 's': setter = OO_TRACKING_SETTER( short ); break;
+			case 'S': setter = OO_TRACKING_SETTER( unsigned short ); break;
+			case 'i': case 'l': setter = OO_TRACKING_SETTER( int ); break;
+			case 'I': case 'L': setter = OO_TRACKING_SETTER( unsigned ); break;
+			case 'q': case 'Q': setter = OO_TRACKING_SETTER( long long ); break;
+			case 'f': setter = OO_TRACKING_SETTER( float ); break;
+			case 'd': setter = OO_TRACKING_SETTER( double ); break;
+			case '@':
+				setter = imp_implementationWithBlock( ^( id record, id value ) {
+					ooSetObjectIvar( record, offset, value );
+					ooMarkChanged( record, p );
+				} );
+				break;
+			default:
+				continue;
+		}
+
+		OOString name = OOFormat( @"set%@%@:", [[*column substringToIndex:1] uppercaseString], [*column substringFromIndex:1] );
+		char types[] = { 'v', '@', ':', plan[p].type, 0 };
+		class_addMethod( recordClass, sel_registerName( name ), setter, types );
+		plan[p].tracked = 1;
+		untracked -= column;
+	}
+}
+
+/**
+ Leave the ooDeferredColumns of a class out of the columns selected and give each of them
+ a getter that loads the value the first time it is called. Only object columns other
+ than dates can be deferred. Code accessing the ivar directly needs to call the getter
+ or -[OODatabase deferredColumn:ofRecord:] first. Inserts, updates and exports always go
+ through the getter so a column that was never loaded is not written back as null.
+ */
+
+- (void)addDeferredGetters:(cOOStringArray)deferred {
+	for ( int p=0 ; p<nplan ; p++ ) {
+		OOString column = plan[p].name;
+		if ( ![*deferred containsObject:*column] )
+			continue;
+		if ( plan[p].type != '@' || plan[p].date || plan[p].rowid || [*keys containsObject:*column] ) {
+			OOWarn( @"-[OOMetaData addDeferredGetters:] Column %@ of class %@ can not be deferred", *column, *recordClassName );
+			continue;
+		}
+		if ( ooHasAccessor( recordClass, column, NO ) ) {
+			OOWarn( @"-[OOMetaData addDeferredGetters:] Deferred column %@ of class %@ has a getter", *column, *recordClassName );
+			continue;
+		}
+
+		NSString *name = *column;
+		ptrdiff_t offset = plan[p].offset;
+		IMP getter = imp_implementationWithBlock( ^id ( id record ) {
+			id value = *(OO_UNSAFE id *)((char *)OO_BRIDGE(void *)record + offset);
+			if ( !value && [objc_getAssociatedObject( record, &kOOUnloadedKey ) containsIndex:p] ) {
+				OODatabase *database = objc_getAssociatedObject( record, &kOODatabaseKey );
+				return [database ? database : [OODatabase sharedInstance] deferredColumn:name ofRecord:record];
+			}
+			return value != (id)kCFNull ? value : nil;
+		} );
+
+		class_addMethod( recordClass, sel_registerName( column ), getter, "@@:" );
+		plan[p].deferred = 1;
+		plan[p].getDirect = 0;
+		deferredColumns += *column;
+		outcols -= *column;
+	}
+}
+
+- (void)dealloc {
+	free( plan );
+	OO_DEALLOC( super );
+}
+
 /**
  Find the columns shared between two classes and that have upper case names (are indexed).
  */
 
 - (OOStringArray)naturalJoinTo:(cOOStringArray)to {
     //NSLog( @"%@ -- %@", *columns, *to );
-	OOStringArray commonColumns = columns & to;
-	for ( int i=0 ; i<commonColumns ; i++ )
-		if ( islower( (*commonColumns[i])[0] ) )
-			~commonColumns[i--];
+	NSSet *other = [NSSet setWithArray:*to];
+	OOStringArray commonColumns;
+	for ( NSString *column in *columns )
+		if ( !islower( [column characterAtIndex:0] ) && [other containsObject:column] )
+			commonColumns += column;
 	return commonColumns;
 }
 
+/**
+ Columns shared with another table by which a natural join is made. These are determined
+ once for each pair of tables.
+ */
+
+- (OOStringArray)naturalJoinToTable:(OOMetaData *)other {
+	@synchronized( self ) {
+		NSArray *shared = naturalJoins[other->recordClassName];
+		if ( !shared )
+			naturalJoins[other->recordClassName] = shared = [self naturalJoinTo:other->joinableColumns];
+		return shared;
+	}
+}
+
 /**
  Encode values ready for insertion into the database (convert OOString to NSString etc.)
  */
@@ -1081,10 +5206,145 @@ static OOMetaData *tableOfTables;
 	for ( NSString *key in *dates )
 		values[key] = [NSNumber numberWithDouble:[(id)values[key] timeIntervalSince1970]];
 	for ( NSString *key in *archived )
-		values[key] = (NSValue *)[NSKeyedArchiver archivedDataWithRootObject:values[key]];
+		values[key] = (NSValue *)[*codecs[key] encodeColumnValue:values[key]];
+	return values;
+}
+
+/**
+ Encode the values of a record's output columns ready for binding reading the ivars directly
+ where possible rather than using dictionaryWithValuesForKeys: followed by encode:
+ */
+
+- (OOValueDictionary)encodeColumns:(cOOStringArray)names ofRecord:(id)record {
+	OOValueDictionary values = [self encode:OO_AUTORELEASE( [[record dictionaryWithValuesForKeys:names] mutableCopy] )];
+	for ( NSString *key in [*values allKeys] )
+		if ( ![*names containsObject:key] )
+			values -= key;
+	return values;
+}
+
+/**
+ Read back the codec each archived column was created with from the comment after it in
+ the create table statement of an existing table. When +ooColumnCodecs has changed since,
+ the recorded codec continues to be used so the values already stored can be read.
+ */
+
+- (void)useCodecsRecordedIn:(cOOString)sql {
+	for ( NSString *line in [*sql componentsSeparatedByString:@"\n"] ) {
+		NSArray *words = [[line stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]]
+						  componentsSeparatedByString:@" "];
+		NSUInteger nwords = [words count];
+
+		// column type /* ivartype codec */ - tables from before codecs have no codec
+		if ( nwords < 6 || ![*archived containsObject:[words objectAtIndex:0]] ||
+			![[words lastObject] isEqualToString:@"*/"] )
+			continue;
+
+		NSString *column = [words objectAtIndex:0], *recorded = [words objectAtIndex:nwords-2];
+		if ( [recorded isEqualToString:NSStringFromClass( [*codecs[column] class] )] )
+			continue;
+
+		Class codecClass = NSClassFromString( recorded );
+		if ( ![codecClass conformsToProtocol:@protocol(OOColumnCodec)] ) {
+			OOWarn( @"-[OOMetaData useCodecsRecordedIn:] Unknown codec %@ for column %@ of table %@", recorded, column, *tableName );
+			continue;
+		}
+
+		OOWarn( @"-[OOMetaData useCodecsRecordedIn:] Column %@ of table %@ was created using codec %@ which will continue to be used",
+			   column, *tableName, recorded );
+		id codec = [codecClass respondsToSelector:@selector(sharedInstance)] ?
+			[codecClass sharedInstance] : OO_AUTORELEASE( [[codecClass alloc] init] );
+		codecs[column] = codec;
+		for ( int p=0 ; p<nplan ; p++ )
+			if ( strcmp( plan[p].name, [column UTF8String] ) == 0 )
+				plan[p].codec = codec;
+	}
+}
+
+/**
+ Copy the ivars of the columns with a tracking setter so direct assignments can be found
+ and undone. Objects are compared by identity so they are held until commit or rollback.
+ */
+
+- (NSData *)ivarsOf:(id)record holding:(NSMutableArray *)held {
+	NSMutableData *ivars = [NSMutableData dataWithLength:nplan * sizeof (long long)];
+	char *slot = (char *)[ivars mutableBytes];
+
+	for ( int p=0 ; p<nplan ; p++, slot += sizeof (long long) )
+		if ( plan[p].tracked ) {
+			void *ivar = (char *)OO_BRIDGE(void *)record + plan[p].offset;
+			if ( plan[p].type == '@' && *(OO_UNSAFE id *)ivar )
+				[held addObject:*(OO_UNSAFE id *)ivar];
+			memcpy( slot, ivar, ooIvarSize( plan[p].type ) );
+		}
+
+	return ivars;
+}
+
+- (void)addIvarsOf:(id)record changedSince:(NSData *)ivars to:(NSMutableIndexSet *)changes {
+	const char *slot = (const char *)[ivars bytes];
+	for ( int p=0 ; p<nplan ; p++, slot += sizeof (long long) )
+		if ( plan[p].tracked && memcmp( slot, (char *)OO_BRIDGE(void *)record + plan[p].offset,
+									   ooIvarSize( plan[p].type ) ) != 0 )
+			[changes addIndex:p];
+}
+
+- (void)restoreIvarsOf:(id)record from:(NSData *)ivars {
+	const char *slot = (const char *)[ivars bytes];
+	for ( int p=0 ; p<nplan ; p++, slot += sizeof (long long) )
+		if ( !plan[p].tracked )
+			continue;
+		else if ( plan[p].type == '@' )
+			ooSetObjectIvar( record, plan[p].offset, *(OO_UNSAFE id *)slot );
+		else
+			memcpy( (char *)OO_BRIDGE(void *)record + plan[p].offset, slot, ooIvarSize( plan[p].type ) );
+}
+
+- (OOValueDictionary)encodeRecord:(id)record {
+	if ( !plan )
+		return [self encode:OO_AUTORELEASE( [[record dictionaryWithValuesForKeys:columns] mutableCopy] )];
+
+	OOValueDictionary values;
+	for ( int p=0 ; p<nplan ; p++ )
+		values[plan[p].name] = [self valueForPlan:p ofRecord:record];
 	return values;
 }
 
+- (id)valueForPlan:(int)p ofRecord:(id)record {
+	const struct _ooIvarPlan &entry = plan[p];
+	void *ivar = (char *)OO_BRIDGE(void *)record + entry.offset;
+	id value;
+
+	switch ( entry.getDirect ? entry.type : 0 ) {
+		case 'c': return [NSNumber numberWithChar:*(char *)ivar];
+		case 'C': return [NSNumber numberWithUnsignedChar:*(unsigned char *)ivar];
+		case 's': return [NSNumber numberWithShort:*(short *)ivar];
+		case 'S': return [NSNumber numberWithUnsignedShort:*(unsigned short *)ivar];
+		case 'i': case 'l': return [NSNumber numberWithInt:*(int *)ivar];
+		case 'I': case 'L': return [NSNumber numberWithUnsignedInt:*(unsigned *)ivar];
+		case 'q': case 'Q': return [NSNumber numberWithLongLong:*(long long *)ivar];
+		case 'f': return [NSNumber numberWithFloat:*(float *)ivar];
+		case 'd': return [NSNumber numberWithDouble:*(double *)ivar];
+		case '@': case '{':
+			value = *(OO_UNSAFE id *)ivar;
+			if ( value == (id)kCFNull )
+				value = nil;
+			break;
+		default:
+			value = [record valueForKey:[NSString stringWithUTF8String:entry.name]];
+			if ( entry.unbox )
+				value = (id)[value pointerValue];
+			if ( value == OONull )
+				value = nil;
+	}
+
+	if ( entry.date )
+		return value ? [NSNumber numberWithDouble:[value timeIntervalSince1970]] : OONull;
+	if ( entry.archived )
+		return (NSValue *)[entry.codec encodeColumnValue:value ? value : OONull];
+	return value ? value : OONull;
+}
+
 /**
  Decode values taken from the database for use in [record setValuesForKeysWithDictionary:values];
  */
@@ -1093,7 +5353,7 @@ static OOMetaData *tableOfTables;
 	id value;
 	for ( NSString *key in *archived )
 		if ( (value = values[key]) )
-			values[key] = [NSKeyedUnarchiver unarchiveObjectWithData:(NSData *)value];
+			values[key] = [*codecs[key] decodeColumnData:(NSData *)value];
 	for ( NSString *key in *dates )
 		if ( (value = values[key]) )
 			values[key] = (id)[NSDate dateWithTimeIntervalSince1970:[value doubleValue]];
@@ -1139,8 +5399,22 @@ static OOMetaData *tableOfTables;
 
 + (OOArray<id>)import:(cOOString)string intoClass:(Class)recordClass delimiter:(cOOString)delim {
 	OOMetaData *metaData = [self metaDataForClass:recordClass];
-	// remove escaped newlines then split by newline
-	OOStringArray lines = (string - @"\\\\\n") / @"\n";
+	// split by newline joining lines ended by a backslash escaping a newline in a value
+	OOStringArray lines;
+	NSMutableString *line = nil;
+	for ( NSString *part in [*string componentsSeparatedByString:@"\n"] ) {
+		if ( !line )
+			line = [NSMutableString string];
+		if ( [part hasSuffix:@"\\"] ) {
+			[line appendString:[part substringToIndex:[part length]-1]];
+			[line appendString:@"\n"];
+		}
+		else {
+			[line appendString:part];
+			lines += line;
+			line = nil;
+		}
+	}
 	lines--; // pop last empty line
 
 	OOArray<id> out;
@@ -1166,6 +5440,84 @@ static OOMetaData *tableOfTables;
 	return out;
 }
 
+/**
+ Write one column of a record using the plan to read scalar ivars directly.
+ */
+
+- (void)export:(int)p ofRecord:(id)record to:(OOExportWriter &)out {
+	const struct _ooIvarPlan &entry = plan[p];
+	const char *ivar = (const char *)OO_BRIDGE(void *)record + entry.offset;
+
+	switch ( entry.getDirect ? entry.type : 0 ) {
+		case 'c': out.put( (long long)*(char *)ivar ); return;
+		case 'C': out.put( (long long)*(unsigned char *)ivar ); return;
+		case 's': out.put( (long long)*(short *)ivar ); return;
+		case 'S': out.put( (long long)*(unsigned short *)ivar ); return;
+		case 'i': case 'l': out.put( (long long)*(int *)ivar ); return;
+		case 'I': case 'L': out.put( (long long)*(unsigned *)ivar ); return;
+		case 'q': out.put( *(long long *)ivar ); return;
+		case 'Q': out.put( *(unsigned long long *)ivar ); return;
+		case 'f': out.put( *(float *)ivar, 7 ); return;
+		case 'd': out.put( *(double *)ivar, 16 ); return;
+	}
+
+	@autoreleasepool {
+		out.putObject( [self valueForPlan:p ofRecord:record] );
+	}
+}
+
+/**
+ Stream records, typically from a cursor, to a file in the format written by export:delimiter:
+ without building the export in memory. Returns the number of records written or -1 on error.
+ */
+
++ (long)export:(id <NSFastEnumeration>)records toFile:(cOOString)path delimiter:(cOOString)delim {
+	int fd = open( [*path fileSystemRepresentation], O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+	if ( fd < 0 ) {
+		OOWarn( @"+[OOMetaData export:toFile:...] Could not open: %@ - %s", *path, strerror( errno ) );
+		return -1;
+	}
+
+	OOExportWriter out( fd );
+	const char *sep = [*delim UTF8String];
+	size_t seplen = strlen( sep );
+	OOMetaData *metaData = nil;
+	long count = 0;
+
+	for ( id record in records ) {
+		if ( !metaData )
+			metaData = [self metaDataForClass:[record class]];
+
+		if ( metaData->plan ) {
+			BOOL first = YES;
+			for ( int p=0 ; p<metaData->nplan ; p++ ) {
+				if ( metaData->plan[p].rowid )
+					continue;
+				if ( !first )
+					out.put( sep, seplen );
+				[metaData export:p ofRecord:record to:out];
+				first = NO;
+			}
+		}
+		else @autoreleasepool {
+			OOValueDictionary values = [metaData encodeRecord:record];
+			BOOL first = YES;
+			for ( NSString *key in *metaData->columns ) {
+				if ( !first )
+					out.put( sep, seplen );
+				out.putObject( values[key] );
+				first = NO;
+			}
+		}
+
+		out.put( '\n' );
+		count++;
+	}
+
+	out.flush();
+	return out.ok() ? count : -1;
+}
+
 /**
  Convert a set of records selected from the database into a string which can be saved to disk.
  */
@@ -1180,7 +5532,7 @@ static OOMetaData *tableOfTables;
                 OONull : [self metaDataForClass:[record class]];
 
 		OODictionary<NSNumber *> values = metaData == OONull ? record : 
-		*[metaData encode:[[record dictionaryWithValuesForKeys:metaData->columns] mutableCopy]];
+		*[metaData encodeRecord:record];
 
 		OOStringArray line;
 		NSString *blank = @"";